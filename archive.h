@@ -0,0 +1,34 @@
+// The block archive that sim writes with -a, and simdump reads: a header,
+// then a record for each block, in order of block id, as cleaning
+// releases it (and, at the end, the blocks that are left).
+#ifndef ARCHIVE_H
+#define ARCHIVE_H 1
+#include <stdint.h>
+
+#define ARCHIVE_MAGIC "minesim\0"
+#define ARCHIVE_VERSION 1
+
+typedef struct archive_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(archive_record_t)
+    uint32_t seed;          // the run's -r
+    uint32_t nnode;
+} archive_header_t;
+
+// What became of a block.
+enum {
+    ARC_PENDING,            // not decided when the run ended
+    ARC_FINAL,              // on the best chain, under every miner's tip
+    ARC_ORPHAN,             // on a branch that no miner is working on
+};
+
+typedef struct archive_record_s {
+    uint64_t id;
+    uint64_t parent;
+    uint64_t height;
+    uint32_t miner;
+    uint32_t status;        // ARC_*
+} archive_record_t;
+
+#endif
@@ -0,0 +1,29 @@
+// The graph file that simgraph writes from an edge list, and sim maps
+// with -i: a header, then the peer lists in compressed sparse rows. Each
+// link appears in the lists of both of its nodes.
+#ifndef GRAPH_H
+#define GRAPH_H 1
+#include <stdint.h>
+
+#define GRAPH_MAGIC "minenet\0"
+#define GRAPH_VERSION 1
+#define GRAPH_NREGION 16        // (sim's NREGION)
+
+typedef struct graph_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t nnode;
+    uint64_t npeer;             // total length of the peer lists
+} graph_header_t;
+
+// After the header:
+//   uint64_t offset[nnode + 1];    node i's peers are peer[offset[i]]
+//                                  up to (not including) peer[offset[i+1]]
+//   uint32_t peer[npeer];          in increasing order within a list
+//   uint8_t region[nnode];         less than GRAPH_NREGION
+static inline uint64_t graph_size(uint32_t nnode, uint64_t npeer) {
+    return sizeof(graph_header_t) + (nnode + 1ULL) * sizeof(uint64_t) +
+        npeer * sizeof(uint32_t) + nnode;
+}
+
+#endif
@@ -155,12 +155,15 @@ void pt_set_atexit(pt_thread_t * pt, void (*func)(env_t));
 /* should only be called by the macro pt_yield() */
 void pt_enqueue_yield(pt_thread_t * const t);
 
-/* Return which wait list to use (hash table)
- * https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
- * #FNV-1a_hash
+/* Return which wait list to use (hash table). Multiplicative (Fibonacci)
+ * hashing: channels are often the same field of the elements of an array,
+ * and just using the low address bits would crowd them into a few lists
+ * when the element size is a multiple of a power of 2.
  */
 static inline pt_thread_t **pt_get_wait_list(state_t const s, void * chan) {
-    return &s->wait[((uintptr_t)chan >> 4) & (PT_NWAIT-1)];
+    unsigned long long const h =
+        (unsigned long long)(uintptr_t)chan * 0x9e3779b97f4a7c15ULL;
+    return &s->wait[(h >> 32) & (PT_NWAIT-1)];
 }
 
 /* should only be called by the macro pt_wait() */
@@ -5,10 +5,19 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "protothread.h"
+#include "archive.h"
+#include "graph.h"
 
 typedef unsigned char u8;
+typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 
@@ -17,45 +26,152 @@ void fail(char *message) {
     exit(1);
 }
 
-u32 randrange(u32 i) {
-    return random() % i;
+// Random streams (splitmix64). The state is just a counter that the
+// output function scrambles, so a stream is cheap to start anywhere, and
+// saving or restoring it (for an optimistic rollback) is one word. Draws
+// made while the simulation runs must not depend on the order in which
+// nodes happen to be scheduled, otherwise the parallel mode couldn't
+// reproduce a serial run.
+u64 rand_next(u64 *state) {
+    u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
-double current_time;
+u32 seed;           // initial random state
+
+// Every purpose (and node) gets its own stream, so that draws for one
+// don't shift the draws for another.
+enum { RNG_MINING, RNG_MINER, RNG_TOPOLOGY, RNG_REGION, RNG_LATENCY };
+// A node index (or the number of nodes) must fit in the 25 bits below the
+// purpose, so a network has at most 1 << MAX_NODE_SHIFT nodes.
+#define MAX_NODE_SHIFT 24
+u64 rand_stream(u32 purpose, u32 index) {
+    u64 s = ((u64)seed << 32) + ((u64)purpose << 25) + index;
+    return rand_next(&s);
+}
+
+// Uniform in [0,i), by multiplying rather than dividing.
+u32 randrange(u64 *rng, u32 i) {
+    return ((rand_next(rng) >> 32) * i) >> 32;
+}
+
+// Exponentially-distributed draws (mean 1) by the ziggurat method
+// (Marsaglia and Tsang): almost all of them take one random number, a
+// table lookup and a multiply, with no log().
+#define ZIG_N 256
+u64 zig_k[ZIG_N];       // accept outright below this (53-bit scale)
+double zig_w[ZIG_N];    // layer width, scaled to the random number
+double zig_f[ZIG_N];    // density at the layer's edge
+
+void rand_init(void) {
+    double const m = 0x1p53;
+    double d = 7.69711747013104972, t = d;
+    double const v = 3.949659822581572e-3;
+    double const q = v / exp(-d);
+    zig_k[0] = (d / q) * m;
+    zig_k[1] = 0;
+    zig_w[0] = q / m;
+    zig_w[ZIG_N-1] = d / m;
+    zig_f[0] = 1;
+    zig_f[ZIG_N-1] = exp(-d);
+    for (u32 i = ZIG_N-2; i > 0; i--) {
+        d = -log(v / d + exp(-d));
+        zig_k[i+1] = (d / t) * m;
+        t = d;
+        zig_f[i] = exp(-d);
+        zig_w[i] = d / m;
+    }
+}
+
+double rand_exp(u64 *rng) {
+    while (true) {
+        u64 r = rand_next(rng);
+        u32 i = r & (ZIG_N-1);
+        u64 j = r >> 11;
+        double x = j * zig_w[i];
+        if (j < zig_k[i]) return x;
+        if (i == 0) {
+            // the tail, beyond the last layer, is itself exponential
+            return 7.69711747013104972 -
+                log(1.0 - (rand_next(rng) >> 11) * 0x1p-53);
+        }
+        double u = (rand_next(rng) >> 11) * 0x1p-53;
+        if (zig_f[i] + u * (zig_f[i-1] - zig_f[i]) < exp(-x)) return x;
+    }
+}
+
+// Simulated time is in integer nanoseconds, so that the order of events
+// doesn't depend on floating-point rounding, and stays exact however long
+// the simulation runs.
+typedef u64 simtime_t;
+#define SECOND ((simtime_t)1000000000)
+#define TIME_NEVER ((simtime_t)-1)
+
+simtime_t seconds(double s) {
+    return llround(s * SECOND);
+}
+
+double time_sec(simtime_t t) {
+    return (double)t / SECOND;
+}
+
+simtime_t time_min(simtime_t a, simtime_t b) {
+    return a < b ? a : b;
+}
+
+// a + b, but never past TIME_NEVER
+simtime_t time_add(simtime_t a, simtime_t b) {
+    return a > TIME_NEVER - b ? TIME_NEVER : a + b;
+}
 
 typedef struct block_s {
     u64 parent; // first block is the only block with parent = zero
     u64 height; // more than one block can have the same height
+    u64 skip;   // ancestor at block_skip_height(height), see block_ancestor()
     u32 miner;  // which miner found this block
     u32 active; // number of miners actively mining directly on this block
+    u32 ntip;   // number of miners whose tip is this block or descends from it
 } block_t;
 
-block_t *block;     // blockchain, oldest first
-u32 block_nalloc;   // number of allocated blocks
-u32 nblock;         // len(block)
-u64 baseblockid;    // blocks[0] corresponds to this block id
-u32 ntips;          // number of blocks being actively mined on
-u32 maxreorg;       // greatest depth reorg
-double totalhash;   // sum of miners' hashrates
+#define NOBLOCK ((u64)-1)
 
-void block_init(void) {
-    block_nalloc = 1;
-    block = calloc(block_nalloc, sizeof(block_t));
-    block[0] = (block_t) { 0, 0, 0, 0 };
-    nblock = 1;
-    baseblockid = 1000; // arbitrary but helps distinguish ids from heights
-    ntips = 0;
-}
+// The blockchain is kept in fixed-size chunks, by block id: chunk c holds
+// ids c*BLOCK_CHUNK on. The chunks in use are in a ring of pointers, so
+// new ones are added at the end, and cleaning releases the ones at the
+// start, without moving any block.
+#define BLOCK_SHIFT 10
+#define BLOCK_CHUNK (1 << BLOCK_SHIFT)
+block_t **blockchunk;   // ring, chunk c is at c % nchunk_alloc
+u32 nchunk_alloc;       // (a power of 2)
+u64 firstchunk;         // chunks in use are [firstchunk, endchunk)
+u64 endchunk;
+block_t *block_spare;   // a released chunk, for reuse
+u32 nblock;             // number of blocks (from baseblockid)
+u64 baseblockid;        // oldest block
+u32 ntips;              // number of blocks being actively mined on
+double totalhash;       // sum of miners' hashrates
+double block_interval = 300;    // mean seconds between blocks (-b)
 
-// allocate one new block, return its index.
-u32 block_alloc(void) {
-    if (nblock == block_nalloc) {
-        block_nalloc *= 2;
-        block = realloc(block, block_nalloc*sizeof(block_t));
-        if (!block) fail("out of memory!");
-        memset(&block[nblock], 0, nblock*sizeof(block_t));
+// Add a (zeroed) chunk at the end of the ring.
+void block_chunk_add(void) {
+    if (endchunk - firstchunk == nchunk_alloc) {
+        block_t **bc = malloc(2*nchunk_alloc*sizeof(block_t *));
+        if (!bc) fail("out of memory!");
+        for (u64 c = firstchunk; c < endchunk; c++) {
+            bc[c & (2*nchunk_alloc-1)] = blockchunk[c & (nchunk_alloc-1)];
+        }
+        free(blockchunk);
+        blockchunk = bc;
+        nchunk_alloc *= 2;
     }
-    return nblock++;
+    block_t *chunk = block_spare;
+    block_spare = NULL;
+    if (chunk) memset(chunk, 0, BLOCK_CHUNK*sizeof(block_t));
+    else chunk = calloc(BLOCK_CHUNK, sizeof(block_t));
+    if (!chunk) fail("out of memory!");
+    blockchunk[endchunk++ & (nchunk_alloc-1)] = chunk;
 }
 
 bool validblock(u64 blockid) {
@@ -65,76 +181,460 @@ bool validblock(u64 blockid) {
 block_t *getblock(u64 blockid) {
     assert(blockid >= baseblockid);
     assert(blockid < baseblockid + nblock);
-    return &block[blockid - baseblockid];
+    return &blockchunk[(blockid >> BLOCK_SHIFT) & (nchunk_alloc-1)]
+        [blockid & (BLOCK_CHUNK-1)];
 }
+
+// Allocate one new (zeroed) block, return its id.
+u64 block_alloc(void) {
+    u64 const blockid = baseblockid + nblock;
+    if ((blockid >> BLOCK_SHIFT) == endchunk) block_chunk_add();
+    nblock++;
+    return blockid;
+}
+
 u64 getheight(u64 blockid) {
     return getblock(blockid)->height;
 }
 
+void block_init(void) {
+    baseblockid = 1000; // arbitrary but helps distinguish ids from heights
+    nchunk_alloc = 1;
+    blockchunk = malloc(sizeof(block_t *));
+    if (!blockchunk) fail("out of memory!");
+    firstchunk = endchunk = baseblockid >> BLOCK_SHIFT;
+    block_chunk_add();
+    nblock = 1;
+    getblock(baseblockid)->skip = NOBLOCK;
+    ntips = 0;
+}
+
+// Each block has a pointer back to one more distant ancestor, as well as
+// its parent, at a height that depends only on its own (as in Bitcoin
+// Core's CBlockIndex::pskip), so that any ancestor is O(log n) jumps away.
+// If that ancestor had already been cleaned away when the block was
+// mined, skip is NOBLOCK; no query needs to go that far back.
+u64 clear_lowest_one(u64 n) {
+    return n & (n - 1);
+}
+u64 block_skip_height(u64 height) {
+    if (height < 2) return 0;
+    return (height & 1) ? clear_lowest_one(clear_lowest_one(height - 1)) + 1 :
+        clear_lowest_one(height);
+}
+
+// The ancestor of the given block at the given height (which must be no
+// lower than baseblockid's).
+u64 block_ancestor(u64 blockid, u64 height) {
+    block_t *bp = getblock(blockid);
+    while (bp->height > height) {
+        u64 const sh = block_skip_height(bp->height);
+        u64 const shprev = block_skip_height(bp->height - 1);
+        // Take the skip unless it goes too far, or the parent's skip
+        // would get there in fewer steps.
+        if (validblock(bp->skip) && (sh == height ||
+                (sh > height && !(shprev + 2 < sh && shprev >= height)))) {
+            blockid = bp->skip;
+        } else {
+            blockid = bp->parent;
+        }
+        bp = getblock(blockid);
+    }
+    return blockid;
+}
+
+// The newest block that's an ancestor of both (the fork point); both must
+// descend from baseblockid.
+u64 block_fork(u64 a, u64 b) {
+    u64 const ha = getheight(a), hb = getheight(b);
+    if (ha > hb) a = block_ancestor(a, hb);
+    if (hb > ha) b = block_ancestor(b, ha);
+    // At the same height, the skips are to the same height, too.
+    while (a != b) {
+        block_t *pa = getblock(a), *pb = getblock(b);
+        if (validblock(pa->skip) && validblock(pb->skip) &&
+                pa->skip != pb->skip) {
+            a = pa->skip;
+            b = pb->skip;
+        } else {
+            a = pa->parent;
+            b = pb->parent;
+        }
+    }
+    return a;
+}
+
+// The same, one parent at a time (to check block_fork()).
+u64 block_fork_walk(u64 a, u64 b) {
+    while (getheight(a) > getheight(b)) a = getblock(a)->parent;
+    while (getheight(b) > getheight(a)) b = getblock(b)->parent;
+    while (a != b) {
+        a = getblock(a)->parent;
+        b = getblock(b)->parent;
+    }
+    return a;
+}
+
+// Events refer to blocks by the low 32 bits of the id. The full id is the
+// one nearest baseblockid; a block that's been cleaned away comes back as
+// an id past the end of the store, so it's still not validblock().
+u32 block_ref(u64 blockid) {
+    return (u32)blockid;
+}
+u64 block_deref(u32 ref) {
+    return baseblockid + (u32)(ref - (u32)baseblockid);
+}
+
+typedef struct part_s part_t;
+
+// What an event does when it fires; see notify[].
+enum { EV_NONE, EV_DELAY, EV_RELAY, EV_ARRIVAL, EV_FANOUT, EV_MINE };
+
+// 32 bytes, so two share a cache line.
 typedef struct event_s {
-    double time;        // when (absolute time) the event should fire
-    void (*notify)(protothread_t, u32);
-    u32 next;           // for freelist or node input queue
-    union {
-        struct {
-            u32 ni;             // node index
-        } delay;
-        struct {
-            u32 ni;             // index of receiving node
-            bool mining;        // block arrival from mining or peer
-            u64 blockid;        // parent of new block, or block from peer
-        } new_block;
-    } u;
+    simtime_t time;     // when (absolute time) the event should fire
+    u32 src;            // id of the node that posted this event, and its
+    u32 seq;            // post sequence number (these break time ties)
+    u32 next;           // for free lists and queue lists
+    u32 qpos;           // position in the queue (some backends)
+    u32 ni : 28;        // node it's for (fanout: src's next peer[] index)
+    u32 kind : 3;       // EV_NONE if free
+    u32 mining : 1;     // (relay) block arrival from mining or peer
+    u32 block;          // (relay) block_ref() of the parent of the new
+                        // block, or of the block from a peer
 } event_t;
 
-// unordered
-u32 event_nalloc;       // event[0..event_nalloc-1]
-event_t *event;
-u32 free_events;        // head of list of free event
+// A block arrival destined for a node in another partition; these are
+// exchanged only between parallel windows.
+typedef struct msg_s {
+    simtime_t time;
+    u32 src;
+    u32 seq;
+    u32 ni;             // index of receiving node
+    bool anti;          // cancel src's messages from seq on (optimistic)
+    u64 blockid;
+} msg_t;
+
+typedef struct outbox_s {
+    msg_t *msg;
+    u32 nmsg;
+    u32 nalloc;
+} outbox_t;
+
+// Node state that an event can change; the optimistic engine saves it
+// before each event so that the event can be undone.
+typedef struct nstate_s {
+    u64 tip;
+    u64 tipheight;
+    u64 rng;
+    u64 mined;
+    u32 seq;
+    u32 maxreorg;
+    u64 arrived;
+    u64 inbox;
+    u64 inbox_mined;
+} nstate_t;
+
+// What became of the deliveries of relayed blocks.
+typedef struct relay_stats_s {
+    u64 sent;           // messages and fanout deliveries put in flight
+    u64 coalesced;      // not sent, the peer was known to have as good
+    u64 ignored;        // dropped on arrival, as dominated
+    u64 lost;           // not sent, the link lost it (see link_delay())
+} relay_stats_t;
+
+typedef struct twlog_s {
+    event_t ev;         // copy of the dispatched event
+    u32 ni;             // node it was delivered to
+    nstate_t before;    // that node's state before the event
+    event_t mining;     // the mining event it removed (unless EV_NONE)
+    bool dropped;       // it wasn't delivered (see event_dominated())
+    relay_stats_t relay;    // the partition's counts before it
+    u32 link;           // the node's peer[] entry whose heard it raised
+    u32 heard;          // (and the old value), link is NOPEER if none
+    bool finished;      // (fanout) it had no more peers to deliver to
+    u32 fanout;         // (fanout) the event, which is kept until fossil
+} twlog_t;
 
-void event_init(void) {
-    event_nalloc = 1;
-    event = calloc(1, sizeof(event_t));
-    event[0].next = 1;
-    free_events = 0;
+// All events posted by node src from sequence number seq on.
+typedef struct cancel_s {
+    u32 src;
+    u32 seq;
+} cancel_t;
+
+// Event queue backends; see queues[] below.
+#define QEND 0xffffffff     // end of a list linked through event_t.next
+
+typedef struct calendar_s {
+    u32 *bucket;        // sorted lists
+    u32 nbucket;        // power of 2
+    simtime_t width;    // (simulated) time covered by a bucket
+    u64 cur;            // time/width of the earliest event (or less)
+    u32 first;          // earliest event, QEND if not yet known
+} calendar_t;
+
+#define LADDER_THRES 50     // a bucket with more events spawns a rung
+#define LADDER_NRUNG 8
+
+typedef struct rung_s {
+    u32 *bucket;        // unsorted lists
+    u32 *count;         // number of events in each bucket
+    u32 nbucket;
+    u32 nalloc;
+    u32 cur;            // buckets before this one have been emptied
+    simtime_t start;    // time of bucket 0
+    simtime_t width;
+} rung_t;
+
+typedef struct ladder_s {
+    u32 top;            // unsorted list of the events after topstart
+    u32 ntop;
+    simtime_t topmin;
+    simtime_t topmax;
+    simtime_t topstart;
+    rung_t rung[LADDER_NRUNG];
+    u32 nrung;
+    u32 bottom;         // sorted list of the earliest events
+    u32 nbottom;
+} ladder_t;
+
+typedef struct radix_s {
+    u64 last;           // key of the latest popped event
+    u32 *bucket[65];    // unsorted arrays
+    u32 n[65];
+    u32 nalloc[65];
+} radix_t;
+
+// d-ary heap entry
+typedef struct dkey_s {
+    simtime_t time;
+    u32 src;
+    u32 e;
+} dkey_t;
+
+typedef struct queue_s queue_t;
+
+// Events are allocated in chunks that never move, so a handle stays valid
+// and growing the pool doesn't copy anything. Each chunk has its own free
+// list, so that events in use tend to stay packed in a few chunks.
+#define EVCHUNK_SHIFT 10
+#define EVCHUNK (1 << EVCHUNK_SHIFT)
+typedef struct evchunk_s {
+    event_t *event;     // event[0..EVCHUNK-1]
+    u32 free;           // handle of a free event, or QEND
+    u32 nfree;
+    u32 next;           // next chunk with free events
+} evchunk_t;
+
+// A partition is a subset of the nodes with everything needed to
+// simulate them: an event pool, a time-ordered queue and a scheduler.
+// The serial simulation is a single partition.
+struct part_s {
+    u32 pi;             // my partition index
+    protothread_t pt;
+    simtime_t current_time;
+    // unordered
+    evchunk_t *evchunk; // see event_get()
+    u32 nevchunk;
+    u32 evchunk_nalloc;
+    u32 evchunk_avail;  // chunks with free events, linked through next
+    // time-ordered queue, entries are event handles
+    queue_t const *queue;   // backend
+    u32 nqueue;         // number of queued events
+    u32 *heap;          // binary heap: heap[0..nqueue-1]
+    u32 heap_nalloc;
+    calendar_t cal;
+    ladder_t ladder;
+    radix_t radix;
+    dkey_t *dheap;      // d-ary heap: dheap[0..nqueue-1]
+    dkey_t *dheap_mem;  // (its allocation)
+    u32 dheap_nalloc;
+    u32 *dheap_pos;     // dheap_pos[e] is event e's position in dheap
+    u32 dheap_npos;
+    outbox_t *outbox;   // outbox[i] holds messages for partition i
+    u64 nevent;         // number of events dispatched
+    u64 nremoved;       // superseded mining events removed from the queue
+    relay_stats_t relay;
+    bool stall;         // stopped at a mining event (parallel only)
+    pthread_t thread;
+    // optimistic (Time Warp) mode only
+    twlog_t *log;       // events dispatched but not yet committed, in order
+    u32 nlog;
+    u32 log_nalloc;
+    msg_t *inbox;       // messages taken from other partitions' outboxes
+    u32 ninbox;
+    u32 inbox_nalloc;
+    cancel_t *cancel;   // events to annihilate (sorted by src)
+    u32 ncancel;
+    u32 cancel_nalloc;
+    simtime_t commit_time;  // time of the latest committed event
+    u64 nundone;        // number of dispatched events that were undone
+    bool keep_fanouts;  // finished fanout events may yet be rolled back
+    u64 nrollback;
+    u32 node_first;     // we simulate nodes [node_first, node_end)
+    u32 node_end;
+};
+
+u32 npart;          // 1 means serial
+part_t *part;
+
+static inline bool part_has(part_t *p, u32 ni) {
+    return ni - p->node_first < p->node_end - p->node_first;
 }
 
-bool event_pending(u32 e) {
-    return event[e].time > current_time;
+// An event handle is its chunk index, then its index within the chunk.
+static inline event_t *event_get(part_t *p, u32 e) {
+    return &p->evchunk[e >> EVCHUNK_SHIFT].event[e & (EVCHUNK-1)];
 }
 
-// time-ordered priority queue, entries are indices into events[]
-u32 *heap;  // heap[0..event_nalloc-1]
-u32 nheap;  // number of valid items currently in the heap
+void event_init(part_t *p) {
+    p->evchunk = NULL;
+    p->nevchunk = 0;
+    p->evchunk_nalloc = 0;
+    p->evchunk_avail = QEND;
+}
 
-void heap_init(void) {
-    heap = calloc(1, sizeof(u32));
-    nheap = 0;
+bool event_pending(part_t *p, u32 e) {
+    return event_get(p, e)->time > p->current_time;
 }
 
-// append to the end of the array, then "bubble" it upwards
-void heap_add(u32 n) {
-    assert(nheap < event_nalloc);
-    u32 i = nheap++;
+// Events are ordered by time, ties are broken by poster and then by the
+// order in which it posted them, so that the order of simultaneous events
+// doesn't depend on how the nodes are partitioned.
+bool event_before(event_t *a, event_t *b) {
+    if (a->time != b->time) return a->time < b->time;
+    if (a->src != b->src) return a->src < b->src;
+    return a->seq < b->seq;
+}
+
+// The event queue interface. All backends order the events by
+// event_before(), so they all produce identical simulations.
+struct queue_s {
+    char const *name;
+    void (*init)(part_t *p);
+    void (*add)(part_t *p, u32 e);
+    u32 (*pop)(part_t *p);      // remove and return the earliest event
+    u32 (*first)(part_t *p);    // return the earliest event
+    void (*remove)(part_t *p, u32 e);   // remove a queued event
+    // Remove the events that doomed() returns true for (it may free
+    // them), return how many.
+    u32 (*cancel)(part_t *p, bool (*doomed)(part_t *, u32));
+};
+
+void queue_add(part_t *p, u32 e) {
+    p->nqueue++;
+    p->queue->add(p, e);
+}
+
+u32 queue_pop(part_t *p) {
+    assert(p->nqueue);
+    p->nqueue--;
+    return p->queue->pop(p);
+}
+
+u32 queue_first(part_t *p) {
+    assert(p->nqueue);
+    return p->queue->first(p);
+}
+
+void queue_remove(part_t *p, u32 e) {
+    assert(p->nqueue);
+    p->nqueue--;
+    p->queue->remove(p, e);
+}
+
+void queue_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    p->nqueue -= p->queue->cancel(p, doomed);
+}
+
+typedef struct qkey_s {
+    simtime_t time;
+    u32 src;
+    u32 seq;
+    u32 e;
+} qkey_t;
+
+int qkey_cmp(void const *a, void const *b) {
+    qkey_t const *ka = a, *kb = b;
+    if (ka->time != kb->time) return ka->time < kb->time ? -1 : 1;
+    if (ka->src != kb->src) return ka->src < kb->src ? -1 : 1;
+    return ka->seq < kb->seq ? -1 : ka->seq > kb->seq;
+}
+
+// Sort the list of events (linked through next) and return it.
+u32 list_sort(part_t *p, u32 list, u32 n) {
+    qkey_t *k = malloc(n*sizeof(qkey_t));
+    if (!k) fail("out of memory!");
+    u32 i = 0;
+    for (u32 e = list; e != QEND; e = event_get(p, e)->next) {
+        event_t *ep = event_get(p, e);
+        k[i++] = (qkey_t) { ep->time, ep->src, ep->seq, e };
+    }
+    assert(i == n);
+    qsort(k, n, sizeof(qkey_t), qkey_cmp);
+    list = QEND;
+    while (i--) {
+        event_get(p, k[i].e)->next = list;
+        list = k[i].e;
+    }
+    free(k);
+    return list;
+}
+
+// Insert e into the sorted list at *head.
+void list_insert(part_t *p, u32 *head, u32 e) {
+    event_t *ep = event_get(p, e);
+    while (*head != QEND && event_before(event_get(p, *head), ep)) {
+        head = &event_get(p, *head)->next;
+    }
+    ep->next = *head;
+    *head = e;
+}
+
+// Remove the doomed events from the list at *head, return how many.
+u32 list_cancel(part_t *p, u32 *head, bool (*doomed)(part_t *, u32)) {
+    u32 n = 0;
+    while (*head != QEND) {
+        u32 e = *head;
+        u32 next = event_get(p, e)->next;
+        if (doomed(p, e)) {
+            *head = next;
+            n++;
+        } else {
+            head = &event_get(p, e)->next;
+        }
+    }
+    return n;
+}
+
+// Binary heap. Each queued event's position is kept in event_t.qpos so
+// that it can be removed.
+
+void heap_init(part_t *p) {
+    p->heap_nalloc = 1;
+    p->heap = calloc(1, sizeof(u32));
+}
+
+// move n from position i toward the root until it's in order
+void heap_up(part_t *p, u32 i, u32 n) {
+    u32 * const heap = p->heap;
     while (i) {
         u32 parent = (i-1)/2;
-        if (event[heap[parent]].time < event[n].time) {
+        if (event_before(event_get(p, heap[parent]), event_get(p, n))) {
             break;
         }
         heap[i] = heap[parent];
+        event_get(p, heap[i])->qpos = i;
         i = parent;
     }
     heap[i] = n;
+    event_get(p, n)->qpos = i;
 }
 
-u32 heap_pop(void) {
-    u32 const r = heap[0];
-    if (--nheap == 0) {
-        return r;
-    }
-    // logically we're first moving this last value to a[0]
-    u32 p = heap[nheap];
-    u32 i = 0;
+// move n from position i toward the leaves until it's in order
+void heap_down(part_t *p, u32 i, u32 n) {
+    u32 * const heap = p->heap;
+    u32 const nheap = p->nqueue;
     while (true) {
         u32 lchild = (i*2)+1;
         if (lchild >= nheap) {
@@ -143,225 +643,1837 @@ u32 heap_pop(void) {
         u32 rchild = lchild+1;
         u32 next_i;
         if (rchild >= nheap ||
-                event[heap[lchild]].time < event[heap[rchild]].time) {
+                event_before(event_get(p, heap[lchild]),
+                    event_get(p, heap[rchild]))) {
             next_i = lchild;
         } else {
             next_i = rchild;
         }
-        if (event[p].time < event[heap[next_i]].time) {
-            break;
+        if (event_before(event_get(p, n), event_get(p, heap[next_i]))) {
+            break;
+        }
+        heap[i] = heap[next_i];
+        event_get(p, heap[i])->qpos = i;
+        i = next_i;
+    }
+    heap[i] = n;
+    event_get(p, n)->qpos = i;
+}
+
+// append to the end of the array, then "bubble" it upwards
+void heap_add(part_t *p, u32 n) {
+    if (p->nqueue > p->heap_nalloc) {
+        p->heap_nalloc *= 2;
+        p->heap = realloc(p->heap, p->heap_nalloc*sizeof(u32));
+        if (!p->heap) fail("out of memory!");
+    }
+    heap_up(p, p->nqueue - 1, n);
+}
+
+u32 heap_pop(part_t *p) {
+    u32 const r = p->heap[0];
+    // logically we're first moving the last value to a[0]
+    if (p->nqueue) heap_down(p, 0, p->heap[p->nqueue]);
+    return r;
+}
+
+u32 heap_first(part_t *p) {
+    return p->heap[0];
+}
+
+void heap_remove(part_t *p, u32 e) {
+    u32 const i = event_get(p, e)->qpos;
+    if (i == p->nqueue) return;     // it was last
+    // put the last value in its place
+    u32 n = p->heap[p->nqueue];
+    if (i && event_before(event_get(p, n), event_get(p, p->heap[(i-1)/2]))) {
+        heap_up(p, i, n);
+    } else {
+        heap_down(p, i, n);
+    }
+}
+
+u32 heap_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    u32 n = 0;
+    for (u32 i = 0; i < p->nqueue; i++) {
+        u32 e = p->heap[i];
+        if (!doomed(p, e)) p->heap[n++] = e;
+    }
+    u32 r = p->nqueue - n;
+    // rebuild by adding them again
+    for (p->nqueue = 1; p->nqueue <= n; p->nqueue++) {
+        heap_add(p, p->heap[p->nqueue-1]);
+    }
+    p->nqueue += r - 1;     // queue_cancel() subtracts r
+    return r;
+}
+
+// 4-ary heap with the keys inline, so a sift doesn't have to touch
+// event[] until there's a tie in both time and poster. The array is
+// offset so that each node's 4 children share a 64-byte cache line.
+// Positions, for removal, are kept in a separate array indexed by event.
+
+#define DHEAP_D 4
+#define DHEAP_PAD 3     // dheap[0] is at this position in the allocation
+
+dkey_t *dheap_alloc(u32 nalloc) {
+    void *mem;
+    if (posix_memalign(&mem, 64, (DHEAP_PAD + nalloc) * sizeof(dkey_t))) {
+        fail("out of memory!");
+    }
+    return mem;
+}
+
+void dheap_init(part_t *p) {
+    p->dheap_nalloc = DHEAP_D;
+    p->dheap_mem = dheap_alloc(p->dheap_nalloc);
+    p->dheap = p->dheap_mem + DHEAP_PAD;
+}
+
+// same order as event_before()
+static inline bool dkey_before(part_t *p, dkey_t *a, dkey_t *b) {
+    if (a->time != b->time) return a->time < b->time;
+    if (a->src != b->src) return a->src < b->src;
+    return event_get(p, a->e)->seq < event_get(p, b->e)->seq;
+}
+
+void dheap_up(part_t *p, u32 i, dkey_t k) {
+    dkey_t * const h = p->dheap;
+    u32 * const pos = p->dheap_pos;
+    while (i) {
+        u32 parent = (i-1)/DHEAP_D;
+        if (dkey_before(p, &h[parent], &k)) break;
+        h[i] = h[parent];
+        pos[h[i].e] = i;
+        i = parent;
+    }
+    h[i] = k;
+    pos[k.e] = i;
+}
+
+void dheap_down(part_t *p, u32 i, dkey_t k) {
+    dkey_t * const h = p->dheap;
+    u32 * const pos = p->dheap_pos;
+    u32 const n = p->nqueue;
+    while (true) {
+        u32 c = i*DHEAP_D + 1;
+        if (c >= n) break;
+        u32 m = c;
+        if (c + DHEAP_D <= n) {
+            // all children present: a tournament without early exits
+            u32 m1 = dkey_before(p, &h[c+1], &h[c]) ? c+1 : c;
+            u32 m2 = dkey_before(p, &h[c+3], &h[c+2]) ? c+3 : c+2;
+            m = dkey_before(p, &h[m2], &h[m1]) ? m2 : m1;
+        } else {
+            for (u32 j = c+1; j < n; j++) {
+                if (dkey_before(p, &h[j], &h[m])) m = j;
+            }
+        }
+        if (!dkey_before(p, &h[m], &k)) break;
+        h[i] = h[m];
+        pos[h[i].e] = i;
+        i = m;
+    }
+    h[i] = k;
+    pos[k.e] = i;
+}
+
+void dheap_add(part_t *p, u32 e) {
+    if (p->nqueue > p->dheap_nalloc) {
+        u32 nalloc = p->dheap_nalloc * 2;
+        dkey_t *mem = dheap_alloc(nalloc);
+        memcpy(mem + DHEAP_PAD, p->dheap, p->dheap_nalloc*sizeof(dkey_t));
+        free(p->dheap_mem);
+        p->dheap_mem = mem;
+        p->dheap = mem + DHEAP_PAD;
+        p->dheap_nalloc = nalloc;
+    }
+    if (p->dheap_npos < p->nevchunk << EVCHUNK_SHIFT) {
+        p->dheap_npos = p->nevchunk << EVCHUNK_SHIFT;
+        p->dheap_pos = realloc(p->dheap_pos, p->dheap_npos*sizeof(u32));
+        if (!p->dheap_pos) fail("out of memory!");
+    }
+    event_t *ep = event_get(p, e);
+    dheap_up(p, p->nqueue - 1, (dkey_t) { ep->time, ep->src, e });
+}
+
+u32 dheap_pop(part_t *p) {
+    u32 const r = p->dheap[0].e;
+    // logically move the last entry to the root
+    if (p->nqueue) dheap_down(p, 0, p->dheap[p->nqueue]);
+    return r;
+}
+
+u32 dheap_first(part_t *p) {
+    return p->dheap[0].e;
+}
+
+void dheap_remove(part_t *p, u32 e) {
+    u32 const i = p->dheap_pos[e];
+    if (i == p->nqueue) return;     // it was last
+    dkey_t k = p->dheap[p->nqueue];
+    if (i && dkey_before(p, &k, &p->dheap[(i-1)/DHEAP_D])) {
+        dheap_up(p, i, k);
+    } else {
+        dheap_down(p, i, k);
+    }
+}
+
+u32 dheap_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    u32 n = 0;
+    for (u32 i = 0; i < p->nqueue; i++) {
+        if (doomed(p, p->dheap[i].e)) continue;
+        p->dheap_pos[p->dheap[i].e] = n;
+        p->dheap[n++] = p->dheap[i];
+    }
+    u32 r = p->nqueue - n;
+    p->nqueue = n;
+    // heapify bottom-up
+    for (u32 i = n / DHEAP_D + 1; i--;) {
+        if (i < n) dheap_down(p, i, p->dheap[i]);
+    }
+    p->nqueue += r;     // queue_cancel() subtracts r
+    return r;
+}
+
+// Calendar queue (R. Brown, 1988): a hash table of sorted lists, like a
+// desk calendar with one page per day; an event goes on the page for
+// its time, modulo a year. The number of buckets follows the number of
+// events, and the bucket width the (early) event spacing.
+
+#define CAL_MINBUCKET 2
+
+u64 cal_vb(calendar_t *c, simtime_t t) {
+    return t / c->width;
+}
+
+void cal_init(part_t *p) {
+    calendar_t *c = &p->cal;
+    c->nbucket = CAL_MINBUCKET;
+    c->bucket = malloc(c->nbucket*sizeof(u32));
+    for (u32 i = 0; i < c->nbucket; i++) c->bucket[i] = QEND;
+    c->width = SECOND;
+    c->cur = 0;
+    c->first = QEND;
+}
+
+// Rebuild with the given number of buckets, and a width that's three
+// times the average separation of the earliest events.
+void cal_resize(part_t *p, u32 nbucket) {
+    calendar_t *c = &p->cal;
+    u32 const n = p->nqueue;
+    qkey_t *k = malloc(n*sizeof(qkey_t));
+    if (!k) fail("out of memory!");
+    u32 i = 0;
+    for (u32 b = 0; b < c->nbucket; b++) {
+        for (u32 e = c->bucket[b]; e != QEND; e = event_get(p, e)->next) {
+            event_t *ep = event_get(p, e);
+            k[i++] = (qkey_t) { ep->time, ep->src, ep->seq, e };
+        }
+    }
+    assert(i == n);
+    qsort(k, n, sizeof(qkey_t), qkey_cmp);
+    u32 const nsample = n < 25 ? n : 25;
+    if (nsample > 1) {
+        simtime_t avg = (k[nsample-1].time - k[0].time) / (nsample-1);
+        simtime_t sum = 0;
+        u32 nsum = 0;
+        for (i = 1; i < nsample; i++) {
+            simtime_t gap = k[i].time - k[i-1].time;
+            if (gap <= 2*avg) {
+                sum += gap;
+                nsum++;
+            }
+        }
+        if (3 * sum >= nsum) c->width = 3 * sum / nsum;
+    }
+    free(c->bucket);
+    c->nbucket = nbucket;
+    c->bucket = malloc(nbucket*sizeof(u32));
+    if (!c->bucket) fail("out of memory!");
+    for (u32 b = 0; b < nbucket; b++) c->bucket[b] = QEND;
+    // latest first, so each list ends up sorted
+    for (i = n; i--;) {
+        u32 *head = &c->bucket[cal_vb(c, k[i].time) & (nbucket-1)];
+        event_get(p, k[i].e)->next = *head;
+        *head = k[i].e;
+    }
+    c->cur = n ? cal_vb(c, k[0].time) : 0;
+    c->first = n ? k[0].e : QEND;
+    free(k);
+}
+
+void cal_add(part_t *p, u32 e) {
+    calendar_t *c = &p->cal;
+    event_t *ep = event_get(p, e);
+    u64 vb = cal_vb(c, ep->time);
+    list_insert(p, &c->bucket[vb & (c->nbucket-1)], e);
+    if (c->cur > vb) c->cur = vb;
+    if (c->first != QEND && event_before(ep, event_get(p, c->first))) {
+        c->first = e;
+    }
+    if (p->nqueue > 2*c->nbucket) cal_resize(p, 2*c->nbucket);
+}
+
+u32 cal_first(part_t *p) {
+    calendar_t *c = &p->cal;
+    if (c->first != QEND) return c->first;
+    u32 const mask = c->nbucket - 1;
+    for (u32 i = 0; i < c->nbucket; i++) {
+        u32 e = c->bucket[(c->cur + i) & mask];
+        if (e != QEND && cal_vb(c, event_get(p, e)->time) <= c->cur + i) {
+            c->cur += i;
+            return c->first = e;
+        }
+    }
+    // Nothing within a year, search directly.
+    u32 first = QEND;
+    for (u32 b = 0; b < c->nbucket; b++) {
+        u32 e = c->bucket[b];
+        if (e != QEND && (first == QEND ||
+                event_before(event_get(p, e), event_get(p, first)))) {
+            first = e;
+        }
+    }
+    c->cur = cal_vb(c, event_get(p, first)->time);
+    return c->first = first;
+}
+
+u32 cal_pop(part_t *p) {
+    calendar_t *c = &p->cal;
+    u32 e = cal_first(p);
+    u32 *head = &c->bucket[c->cur & (c->nbucket-1)];
+    assert(*head == e);
+    *head = event_get(p, e)->next;
+    c->first = QEND;
+    if (c->nbucket > CAL_MINBUCKET && p->nqueue < c->nbucket/2) {
+        cal_resize(p, c->nbucket/2);
+    }
+    return e;
+}
+
+void cal_remove(part_t *p, u32 e) {
+    calendar_t *c = &p->cal;
+    u32 *head = &c->bucket[cal_vb(c, event_get(p, e)->time) & (c->nbucket-1)];
+    while (*head != e) head = &event_get(p, *head)->next;
+    *head = event_get(p, e)->next;
+    if (c->first == e) c->first = QEND;
+    if (c->nbucket > CAL_MINBUCKET && p->nqueue < c->nbucket/2) {
+        cal_resize(p, c->nbucket/2);
+    }
+}
+
+u32 cal_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    calendar_t *c = &p->cal;
+    u32 n = 0;
+    for (u32 b = 0; b < c->nbucket; b++) {
+        n += list_cancel(p, &c->bucket[b], doomed);
+    }
+    c->first = QEND;
+    return n;
+}
+
+// Ladder queue (W. T. Tang et al, 2005): far future events go unsorted
+// into top; when they're needed they're spread over the buckets of a
+// rung, and each bucket, in turn, is either spread over a finer rung (if
+// it's large) or sorted into bottom, from which events are popped.
+
+void ladder_init(part_t *p) {
+    ladder_t *l = &p->ladder;
+    l->top = QEND;
+    l->ntop = 0;
+    l->topstart = 0;    // no event is that early
+    l->nrung = 0;
+    l->bottom = QEND;
+    l->nbottom = 0;
+}
+
+// the bucket for time t, not limited to nbucket
+u64 rung_bucket(rung_t *r, simtime_t t) {
+    return t < r->start ? 0 : (t - r->start) / r->width;
+}
+
+void rung_push(part_t *p, rung_t *r, u32 e, u64 b) {
+    u32 i = b >= r->nbucket ? r->nbucket-1 : b;
+    event_get(p, e)->next = r->bucket[i];
+    r->bucket[i] = e;
+    r->count[i]++;
+}
+
+// Start a new rung, spreading the list over its buckets.
+void ladder_spawn(part_t *p, u32 list, u32 nbucket,
+        simtime_t start, simtime_t width) {
+    ladder_t *l = &p->ladder;
+    rung_t *r = &l->rung[l->nrung++];
+    if (r->nalloc < nbucket) {
+        r->nalloc = nbucket;
+        free(r->bucket);
+        free(r->count);
+        r->bucket = malloc(nbucket*sizeof(u32));
+        r->count = malloc(nbucket*sizeof(u32));
+        if (!r->bucket || !r->count) fail("out of memory!");
+    }
+    r->nbucket = nbucket;
+    for (u32 i = 0; i < nbucket; i++) {
+        r->bucket[i] = QEND;
+        r->count[i] = 0;
+    }
+    r->cur = 0;
+    r->start = start;
+    r->width = width;
+    while (list != QEND) {
+        u32 next = event_get(p, list)->next;
+        rung_push(p, r, list, rung_bucket(r, event_get(p, list)->time));
+        list = next;
+    }
+}
+
+// Make sure bottom isn't empty (unless the queue is).
+void ladder_prepare(part_t *p) {
+    ladder_t *l = &p->ladder;
+    while (l->bottom == QEND) {
+        if (!l->nrung) {
+            if (l->top == QEND) return;
+            u32 list = l->top, n = l->ntop;
+            l->top = QEND;
+            l->ntop = 0;
+            l->topstart = l->topmax;
+            if (l->topmax == l->topmin) {
+                l->bottom = list_sort(p, list, n);
+                l->nbottom = n;
+            } else {
+                ladder_spawn(p, list, n, l->topmin,
+                    (l->topmax - l->topmin) / n + 1);
+            }
+            continue;
+        }
+        rung_t *r = &l->rung[l->nrung-1];
+        while (r->cur < r->nbucket && r->bucket[r->cur] == QEND) r->cur++;
+        if (r->cur == r->nbucket) {
+            l->nrung--;
+            continue;
+        }
+        u32 list = r->bucket[r->cur], n = r->count[r->cur];
+        simtime_t start = r->start + r->cur * r->width;
+        r->bucket[r->cur] = QEND;
+        r->count[r->cur] = 0;
+        r->cur++;
+        if (n > LADDER_THRES && l->nrung < LADDER_NRUNG && r->width >= n) {
+            ladder_spawn(p, list, n, start, r->width / n);
+        } else {
+            l->bottom = list_sort(p, list, n);
+            l->nbottom = n;
+        }
+    }
+}
+
+void ladder_add(part_t *p, u32 e) {
+    ladder_t *l = &p->ladder;
+    simtime_t const t = event_get(p, e)->time;
+    if (t > l->topstart) {
+        if (l->top == QEND || l->topmin > t) l->topmin = t;
+        if (l->top == QEND || l->topmax < t) l->topmax = t;
+        event_get(p, e)->next = l->top;
+        l->top = e;
+        l->ntop++;
+        return;
+    }
+    for (u32 i = 0; i < l->nrung; i++) {
+        rung_t *r = &l->rung[i];
+        u64 b = rung_bucket(r, t);
+        // (the last bucket also holds everything after it)
+        if (b >= r->cur && r->cur < r->nbucket) {
+            rung_push(p, r, e, b);
+            return;
+        }
+    }
+    if (l->nbottom >= LADDER_THRES && l->nrung < LADDER_NRUNG) {
+        // too long to keep sorted, spread it over a new rung
+        u32 list = l->bottom, n = l->nbottom;
+        simtime_t min = event_get(p, list)->time, max = min;
+        for (u32 i = list; i != QEND; i = event_get(p, i)->next) {
+            max = event_get(p, i)->time;
+        }
+        if (max > min) {
+            l->bottom = QEND;
+            l->nbottom = 0;
+            ladder_spawn(p, list, n, min, (max - min) / (n - 1) + 1);
+            ladder_add(p, e);
+            return;
+        }
+    }
+    list_insert(p, &l->bottom, e);
+    l->nbottom++;
+}
+
+u32 ladder_first(part_t *p) {
+    ladder_prepare(p);
+    return p->ladder.bottom;
+}
+
+u32 ladder_pop(part_t *p) {
+    ladder_prepare(p);
+    u32 e = p->ladder.bottom;
+    p->ladder.bottom = event_get(p, e)->next;
+    p->ladder.nbottom--;
+    return e;
+}
+
+// Find the event where ladder_add() put it.
+void ladder_remove(part_t *p, u32 e) {
+    ladder_t *l = &p->ladder;
+    simtime_t const t = event_get(p, e)->time;
+    u32 *head = &l->bottom;
+    u32 *count = &l->nbottom;
+    if (t > l->topstart) {
+        head = &l->top;
+        count = &l->ntop;
+    } else {
+        for (u32 i = 0; i < l->nrung; i++) {
+            rung_t *r = &l->rung[i];
+            u64 b = rung_bucket(r, t);
+            if (b >= r->cur && r->cur < r->nbucket) {
+                u32 bi = b >= r->nbucket ? r->nbucket-1 : b;
+                head = &r->bucket[bi];
+                count = &r->count[bi];
+                break;
+            }
+        }
+    }
+    while (*head != e) head = &event_get(p, *head)->next;
+    *head = event_get(p, e)->next;
+    (*count)--;
+}
+
+u32 ladder_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    ladder_t *l = &p->ladder;
+    u32 n = list_cancel(p, &l->bottom, doomed);
+    l->nbottom -= n;
+    u32 ntop = list_cancel(p, &l->top, doomed);
+    l->ntop -= ntop;
+    n += ntop;
+    for (u32 i = 0; i < l->nrung; i++) {
+        rung_t *r = &l->rung[i];
+        for (u32 b = r->cur; b < r->nbucket; b++) {
+            u32 nb = list_cancel(p, &r->bucket[b], doomed);
+            r->count[b] -= nb;
+            n += nb;
+        }
+    }
+    return n;
+}
+
+// Radix heap (R. Ahuja et al, 1990), keyed by the event time. Bucket 0
+// holds the events at the latest popped time, bucket i those whose time
+// first differs from it in bit i-1. Only bucket 0 is ever searched; when it's
+// empty, the lowest non-empty bucket is spread over the lower ones.
+
+void radix_init(part_t *p) {
+    memset(&p->radix, 0, sizeof(radix_t));
+}
+
+// the bucket for key k
+u32 radix_bucket(radix_t *r, u64 k) {
+    return k == r->last ? 0 : 64 - __builtin_clzll(k ^ r->last);
+}
+
+void radix_push(part_t *p, u64 k, u32 e) {
+    radix_t *r = &p->radix;
+    u32 b = radix_bucket(r, k);
+    if (r->n[b] == r->nalloc[b]) {
+        r->nalloc[b] = r->nalloc[b] ? r->nalloc[b] * 2 : 16;
+        r->bucket[b] = realloc(r->bucket[b], r->nalloc[b]*sizeof(u32));
+        if (!r->bucket[b]) fail("out of memory!");
+    }
+    event_get(p, e)->qpos = r->n[b];
+    r->bucket[b][r->n[b]++] = e;
+}
+
+// Move bucket b's events to the buckets they now belong in.
+void radix_spread(part_t *p, u32 b) {
+    radix_t *r = &p->radix;
+    u32 const n = r->n[b];
+    r->n[b] = 0;
+    for (u32 i = 0; i < n; i++) {
+        u32 e = r->bucket[b][i];
+        radix_push(p, event_get(p, e)->time, e);
+    }
+}
+
+void radix_add(part_t *p, u32 e) {
+    radix_t *r = &p->radix;
+    u64 k = event_get(p, e)->time;
+    if (k < r->last) {
+        // Only a rollback goes back in time; start over from here.
+        r->last = k;
+        for (u32 b = 0; b < 65; b++) {
+            // a bucket's events can only move to a higher one
+            if (r->n[b]) radix_spread(p, b);
+        }
+    }
+    radix_push(p, k, e);
+}
+
+// Return the position in bucket 0 of the earliest event.
+u32 radix_prepare(part_t *p) {
+    radix_t *r = &p->radix;
+    if (!r->n[0]) {
+        u32 b = 1;
+        while (!r->n[b]) b++;
+        u64 min = event_get(p, r->bucket[b][0])->time;
+        for (u32 i = 1; i < r->n[b]; i++) {
+            u64 k = event_get(p, r->bucket[b][i])->time;
+            if (min > k) min = k;
+        }
+        r->last = min;
+        radix_spread(p, b);
+    }
+    // these all have the same time
+    u32 *b0 = r->bucket[0];
+    u32 first = 0;
+    for (u32 i = 1; i < r->n[0]; i++) {
+        if (event_before(event_get(p, b0[i]), event_get(p, b0[first]))) {
+            first = i;
+        }
+    }
+    return first;
+}
+
+u32 radix_first(part_t *p) {
+    u32 i = radix_prepare(p);
+    return p->radix.bucket[0][i];
+}
+
+u32 radix_pop(part_t *p) {
+    radix_t *r = &p->radix;
+    u32 i = radix_prepare(p);
+    u32 e = r->bucket[0][i];
+    r->bucket[0][i] = r->bucket[0][--r->n[0]];
+    event_get(p, r->bucket[0][i])->qpos = i;
+    return e;
+}
+
+void radix_remove(part_t *p, u32 e) {
+    radix_t *r = &p->radix;
+    u32 b = radix_bucket(r, event_get(p, e)->time);
+    u32 i = event_get(p, e)->qpos;
+    r->bucket[b][i] = r->bucket[b][--r->n[b]];
+    event_get(p, r->bucket[b][i])->qpos = i;
+}
+
+u32 radix_cancel(part_t *p, bool (*doomed)(part_t *, u32)) {
+    radix_t *r = &p->radix;
+    u32 n = 0;
+    for (u32 b = 0; b < 65; b++) {
+        u32 j = 0;
+        for (u32 i = 0; i < r->n[b]; i++) {
+            u32 e = r->bucket[b][i];
+            if (doomed(p, e)) continue;
+            event_get(p, e)->qpos = j;
+            r->bucket[b][j++] = e;
+        }
+        n += r->n[b] - j;
+        r->n[b] = j;
+    }
+    return n;
+}
+
+queue_t const queues[] = {
+    { "heap", heap_init, heap_add, heap_pop, heap_first, heap_remove,
+        heap_cancel },
+    { "dheap", dheap_init, dheap_add, dheap_pop, dheap_first, dheap_remove,
+        dheap_cancel },
+    { "calendar", cal_init, cal_add, cal_pop, cal_first, cal_remove,
+        cal_cancel },
+    { "ladder", ladder_init, ladder_add, ladder_pop, ladder_first,
+        ladder_remove, ladder_cancel },
+    { "radix", radix_init, radix_add, radix_pop, radix_first, radix_remove,
+        radix_cancel },
+};
+#define NQUEUE (sizeof(queues)/sizeof(queues[0]))
+queue_t const *queue = &queues[0];
+
+// Add a chunk of free events (only the small chunk table is reallocated).
+void evchunk_add(part_t *p) {
+    if (p->nevchunk == p->evchunk_nalloc) {
+        p->evchunk_nalloc = p->evchunk_nalloc ? p->evchunk_nalloc * 2 : 16;
+        p->evchunk = realloc(p->evchunk, p->evchunk_nalloc*sizeof(evchunk_t));
+        if (!p->evchunk) fail("out of memory!");
+    }
+    u32 const ci = p->nevchunk++;
+    evchunk_t *c = &p->evchunk[ci];
+    void *mem;
+    if (posix_memalign(&mem, 64, EVCHUNK*sizeof(event_t))) {
+        fail("out of memory!");
+    }
+    c->event = mem;
+    u32 const base = ci << EVCHUNK_SHIFT;
+    for (u32 i = 0; i < EVCHUNK; i++) {
+        c->event[i].kind = EV_NONE;
+        c->event[i].next = i+1 < EVCHUNK ? base+i+1 : QEND;
+    }
+    c->free = base;
+    c->nfree = EVCHUNK;
+    c->next = p->evchunk_avail;
+    p->evchunk_avail = ci;
+}
+
+u32 event_alloc(part_t *p) {
+    if (p->evchunk_avail == QEND) evchunk_add(p);
+    evchunk_t *c = &p->evchunk[p->evchunk_avail];
+    u32 const r = c->free;
+    c->free = c->event[r & (EVCHUNK-1)].next;
+    if (--c->nfree == 0) p->evchunk_avail = c->next;
+    return r;
+}
+
+void event_post(part_t *p, u32 e, simtime_t time) {
+    event_get(p, e)->time = time;
+    if (time > p->current_time) queue_add(p, e);
+}
+
+void event_free(part_t *p, u32 e) {
+    u32 const ci = e >> EVCHUNK_SHIFT;
+    evchunk_t *c = &p->evchunk[ci];
+    event_t *ep = &c->event[e & (EVCHUNK-1)];
+    ep->kind = EV_NONE;
+    ep->next = c->free;
+    c->free = e;
+    if (c->nfree++ == 0) {
+        c->next = p->evchunk_avail;
+        p->evchunk_avail = ci;
+    }
+}
+
+// Return a random interval with Poisson distribution with the given average
+// (in seconds). Useful for block intervals and also network message timings.
+simtime_t poisson(u64 *rng, double average) {
+    return seconds(rand_exp(rng) * average);
+}
+
+typedef struct peer_s {
+    u32 ni;
+    u32 heard;          // greatest height this peer has sent us
+} peer_t;
+
+// A node has a variable number of peers; a fanout event's peer index
+// (event_t.ni) is 28 bits, and this means none.
+#define NOPEER ((1 << 28) - 1)
+#define NOUTBOUND 2     // connections each node makes
+
+// Every node is in one of NREGION regions, and a link's properties depend
+// only on the regions at its ends, so they're in a small table (that
+// stays in cache) rather than in each peer_t. The regions are contiguous
+// ranges of node index, since nodes mostly peer with nearby indices.
+#define NREGION 16
+typedef struct link_s {
+    simtime_t delay;
+    u16 jitter;         // mean extra delay, in 1/256ths of delay
+    u16 loss;           // chance a message is lost, in 1/65536ths
+} link_t;
+link_t region_link[NREGION][NREGION];
+u8 *region;             // by node index
+
+// The latency model (-j, -l): a message's delay is its link's delay plus
+// a heavy-tailed (Lomax, shape 3) multiple of the link's mean jitter, and
+// it may be lost. Both are a hash of the sender and the message's
+// sequence number, so there's no random state to save for a rollback,
+// and a jittered run is as reproducible as any other. The inverse CDF is
+// tabulated, so a draw is a hash and a lookup.
+#define LAT_SHIFT 12
+bool latency_model;
+double jitter_mean, loss_rate;  // as given, each region pair's is near these
+u64 latency_key;
+double lat_icdf[1 << LAT_SHIFT];
+
+void latency_init(void) {
+    latency_key = rand_stream(RNG_LATENCY, 0);
+    for (u32 i = 0; i < (1 << LAT_SHIFT); i++) {
+        double u = (i + 0.5) / (1 << LAT_SHIFT);
+        // (mean 1, scaled by 1/256 for link_t.jitter)
+        lat_icdf[i] = 2 * (pow(1 - u, -1.0/3) - 1) / 256;
+    }
+}
+
+// Place the regions at random on a sphere (the earth); a link's delay is
+// 10 ms plus up to 150 ms for the distance between its regions' centers.
+void region_init(void) {
+    u64 rng = rand_stream(RNG_REGION, 0);
+    double pos[NREGION][3];
+    for (u32 r = 0; r < NREGION; r++) {
+        double z = 2 * ((rand_next(&rng) >> 11) * 0x1p-53) - 1;
+        double a = 2 * M_PI * ((rand_next(&rng) >> 11) * 0x1p-53);
+        pos[r][0] = sqrt(1 - z*z) * cos(a);
+        pos[r][1] = sqrt(1 - z*z) * sin(a);
+        pos[r][2] = z;
+    }
+    for (u32 r = 0; r < NREGION; r++) {
+        for (u32 q = r; q < NREGION; q++) {
+            double c = pos[r][0]*pos[q][0] + pos[r][1]*pos[q][1] +
+                pos[r][2]*pos[q][2];
+            if (c > 1) c = 1;
+            if (c < -1) c = -1;
+            link_t *lk = &region_link[r][q];
+            lk->delay = SECOND / 100 + seconds(0.150 * acos(c) / M_PI);
+            // and they vary, from half to one and a half times the mean
+            double j = jitter_mean * 256 *
+                (0.5 + (rand_next(&rng) >> 11) * 0x1p-53);
+            double l = loss_rate * 65536 *
+                (0.5 + (rand_next(&rng) >> 11) * 0x1p-53);
+            lk->jitter = j < 65535 ? j : 65535;
+            lk->loss = l < 65535 ? l : 65535;
+            region_link[q][r] = *lk;
+        }
+    }
+}
+
+// Order peers by delay (relay() depends on this), then index.
+// (peer_cmp_row is the region_link[] row of the node whose peers these
+// are; each thread that sorts has its own)
+__thread link_t *peer_cmp_row;
+int peer_cmp(void const *a, void const *b) {
+    peer_t const *pa = a, *pb = b;
+    simtime_t da = peer_cmp_row[region[pa->ni]].delay;
+    simtime_t db = peer_cmp_row[region[pb->ni]].delay;
+    if (da != db) return da < db ? -1 : 1;
+    return pa->ni < pb->ni ? -1 : pa->ni > pb->ni;
+}
+
+typedef struct node_s {
+    pt_thread_t pt_thread;
+    pt_func_t pt_func;
+    u32 ni;             // my node index
+    u32 id;             // my index before renumbering (what's reported)
+    u32 delay_event;    // event index
+    u32 mining_event;   // our queued mining event, QEND if none
+    u32 arrival_event;  // our queued arrival event, QEND if none
+    u32 seq;            // number of events we've posted
+    part_t *part;       // partition that simulates us
+    u64 tip;            // blockid of best block *we* know about
+    u64 tipheight;      // height of tip (tip may have been cleaned away)
+    u64 rng;            // random state for mining
+    double hashrate;
+    u64 mined;          // how many total blocks we've mined (including reorg)
+    u64 credit;         // how many best-chain blocks we've mined
+    u32 maxreorg;       // greatest depth reorg we've done
+    u64 arrived;        // best block from a peer this instant, or NOBLOCK
+    // Our thread's inbox: the best block from a peer that it should look
+    // at, and the parent of a block that we've mined, NOBLOCK if none.
+    u64 inbox;
+    u64 inbox_mined;
+    bool rolled;        // state was restored by the current rollback
+    u32 npeer;
+    peer_t *peer;       // our npeer peers, in peer_list[]
+} node_t;
+
+// Arrival events have this src, and the node id as seq, so that they
+// come after all other events at the same time, in node order.
+#define ARRIVAL_SRC 0xffffffff
+// Network-wide mining events have this src, and the block count as seq.
+#define MINING_SRC 0xfffffffe
+
+// later there will be a dynamic set of nodes
+u32 node_shift = 15; // for now 32k nodes
+u32 nnode;      // must be even, 32k for now
+node_t *node;
+u32 nminer;
+u32 *miner;
+peer_t *peer_list;      // every node's peers, one range after another
+// The height a block must exceed to interest node ni: its tip's, or that
+// of a block that's arrived this instant. It's kept apart from node_t,
+// densely, since a relay looks at it for every peer.
+u32 *node_height;
+u32 *node_index;        // by id, the node's index (see node_renumber())
+
+// An imported topology (-i), made by simgraph (see graph.h). It's mapped
+// until the peer lists are made from it.
+char const *graph_path;
+graph_header_t *graph;  // (mapped read-only)
+u64 const *graph_offset;
+u32 const *graph_peer;
+u8 const *graph_region;
+
+void graph_open(void) {
+    int fd = open(graph_path, O_RDONLY);
+    if (fd < 0) fail("can't open graph");
+    struct stat st;
+    if (fstat(fd, &st)) fail("can't stat graph");
+    if ((u64)st.st_size < sizeof(graph_header_t)) fail("not a graph");
+    graph = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (graph == MAP_FAILED) fail("can't map graph");
+    close(fd);
+    if (memcmp(graph->magic, GRAPH_MAGIC, sizeof(graph->magic)) ||
+            graph->version != GRAPH_VERSION ||
+            GRAPH_NREGION != NREGION) {
+        fail("not a graph (or another version)");
+    }
+    if (graph->nnode < 1 ||
+            graph_size(graph->nnode, graph->npeer) != (u64)st.st_size) {
+        fail("corrupt graph");
+    }
+    // (see rand_stream(); relay events, which hold a node index in 28
+    // bits, would allow more)
+    if (graph->nnode > 1u << MAX_NODE_SHIFT) fail("too many nodes in graph");
+    graph_offset = (u64 const *)(graph + 1);
+    graph_peer = (u32 const *)(graph_offset + graph->nnode + 1);
+    graph_region = (u8 const *)(graph_peer + graph->npeer);
+}
+
+// Whether ni is in node mi's (sorted) list in the graph file.
+bool graph_linked(u32 mi, u32 ni) {
+    u64 lo = graph_offset[mi], hi = graph_offset[mi+1];
+    while (lo < hi) {
+        u64 const mid = lo + (hi - lo) / 2;
+        if (graph_peer[mid] < ni) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < graph_offset[mi+1] && graph_peer[lo] == ni;
+}
+
+// Make the peer lists from the graph file's, which are read where
+// they're mapped. They have to be copied (each link has its own heard,
+// and they're sorted by delay, which depends on the seed), and checked,
+// since the simulation assumes that every link is in both its nodes'
+// lists.
+void graph_peers(void) {
+    if (graph_offset[0] != 0 || graph_offset[nnode] != graph->npeer) {
+        fail("corrupt graph");
+    }
+    peer_list = calloc(graph->npeer, sizeof(peer_t));
+    if (!peer_list) fail("out of memory!");
+    for (u32 ni = 0; ni < nnode; ni++) {
+        u64 const start = graph_offset[ni], end = graph_offset[ni+1];
+        if (end < start || end > graph->npeer || end - start >= NOPEER) {
+            fail("corrupt graph");
+        }
+        node_t *np = &node[ni];
+        np->peer = &peer_list[start];
+        np->npeer = end - start;
+        for (u64 j = start; j < end; j++) {
+            u32 const mi = graph_peer[j];
+            if (mi >= nnode || mi == ni ||
+                    (j > start && mi <= graph_peer[j-1]) ||
+                    !graph_linked(mi, ni)) {
+                fail("corrupt graph");
+            }
+            np->peer[j - start].ni = mi;
+        }
+    }
+    munmap(graph, graph_size(nnode, graph->npeer));
+    graph = NULL;
+}
+
+void node_init(void) {
+    if (graph_path) graph_open();
+    nnode = graph ? graph->nnode : 1u << node_shift;
+    node = calloc(nnode, sizeof(node_t));
+    miner = calloc(nnode, sizeof(u32));
+    region = malloc(nnode);
+    node_height = calloc(nnode, sizeof(u32));
+    node_index = malloc(nnode * sizeof(u32));
+    if (!node || !miner || !region || !node_height || !node_index) {
+        fail("out of memory!");
+    }
+    for (u32 ni = 0; ni < nnode; ni++) {
+        node[ni].id = ni;
+        node_index[ni] = ni;
+        region[ni] = graph ? graph_region[ni] : (u64)ni * NREGION / nnode;
+        if (region[ni] >= NREGION) fail("corrupt graph");
+    }
+}
+
+// The topology (-g). With distance (the default), each node, in index
+// order, makes NOUTBOUND connections, preferring nodes that are "close"
+// to it. With regular, the links are NOUTBOUND random cycles through all
+// the nodes, so every node has 2*NOUTBOUND peers (fewer if two cycles
+// share a link). With scalefree, each node, in index order, links to
+// NOUTBOUND earlier nodes chosen in proportion to their number of peers
+// (preferential attachment), so a few nodes have very many. Links are
+// bidirectional. Each model records a node's links as its picks, then
+// topology_init() lays out the peer lists one after another (compressed
+// sparse rows), each sorted by delay (relay() depends on this), then
+// index. (And see implicit, below.)
+enum { TOPO_DISTANCE, TOPO_REGULAR, TOPO_SCALEFREE, TOPO_IMPLICIT };
+u32 topology = TOPO_DISTANCE;
+u32 (*pick)[NOUTBOUND]; // by node, the peers it linked to, NOPEER if none
+
+// Whether node a is among node b's first n picks.
+bool picked(u32 b, u32 a, u32 n) {
+    for (u32 i = 0; i < n; i++) if (pick[b][i] == a) return true;
+    return false;
+}
+
+// The generation steps that take time, at millions of nodes, are run in
+// parallel (with the -p number of threads), over ranges of node index.
+typedef struct range_s {
+    void (*fn)(u32 first, u32 end);
+    u32 first;
+    u32 end;
+    pthread_t thread;
+} range_t;
+
+void *range_thread(void *arg) {
+    range_t *r = arg;
+    r->fn(r->first, r->end);
+    return NULL;
+}
+
+void parallel_range(void (*fn)(u32 first, u32 end)) {
+    if (npart == 1) {
+        fn(0, nnode);
+        return;
+    }
+    range_t *r = calloc(npart, sizeof(range_t));
+    if (!r) fail("out of memory!");
+    for (u32 i = 0; i < npart; i++) {
+        r[i] = (range_t) { fn, (u64)nnode * i / npart,
+            (u64)nnode * (i + 1) / npart, 0 };
+        pthread_create(&r[i].thread, NULL, range_thread, &r[i]);
+    }
+    for (u32 i = 0; i < npart; i++) pthread_join(r[i].thread, NULL);
+    free(r);
+}
+
+// Whether an earlier node already linked to ni (nodes pick in order).
+bool distance_linked(u32 ni, u32 peer_mi) {
+    return peer_mi < ni && picked(peer_mi, ni, NOUTBOUND);
+}
+
+// Whether peer_mi can be node ni's pick i: it isn't one of its earlier
+// picks, nor, when fixing, an earlier node that linked to it.
+bool distance_ok(u32 ni, u32 i, u32 peer_mi, bool fix) {
+    return !picked(ni, peer_mi, i) && !(fix && distance_linked(ni, peer_mi));
+}
+
+// A candidate for node ni's pick i, at a (log-uniform) random distance.
+// If many draws in a row can't be used (only likely in a tiny network),
+// the nearest node that can, NOPEER if there's none.
+#define DISTANCE_TRIES 64
+u32 distance_draw(u64 *rng, u32 ni, u32 i, bool fix) {
+    for (u32 t = 0; t < DISTANCE_TRIES; t++) {
+        u32 d = 1 + randrange(rng, 1 << randrange(rng, node_shift + 1));
+        u32 peer_mi = (ni + d) % nnode;
+        if (distance_ok(ni, i, peer_mi, fix)) return peer_mi;
+    }
+    for (u32 d = 1; d < nnode; d++) {
+        u32 peer_mi = (ni + d) % nnode;
+        if (distance_ok(ni, i, peer_mi, fix)) return peer_mi;
+    }
+    return NOPEER;
+}
+
+// Every node's picks, independently: the only thing they can get wrong
+// is a pick that an earlier node has already linked to, which is rare.
+void distance_picks(u32 first, u32 end) {
+    for (u32 ni = first; ni < end; ni++) {
+        u64 rng = rand_stream(RNG_TOPOLOGY, ni);
+        for (u32 i = 0; i < NOUTBOUND; i++) {
+            pick[ni][i] = distance_draw(&rng, ni, i, false);
+        }
+    }
+}
+
+// Then, in order, redo the nodes that did, ruling those out as well.
+void distance_fix(void) {
+    for (u32 ni = 0; ni < nnode; ni++) {
+        u32 i = 0;
+        while (i < NOUTBOUND && !distance_linked(ni, pick[ni][i])) i++;
+        if (i == NOUTBOUND) continue;
+        u64 rng = rand_stream(RNG_TOPOLOGY, ni);
+        for (i = 0; i < NOUTBOUND; i++) {
+            pick[ni][i] = distance_draw(&rng, ni, i, true);
+        }
+    }
+}
+
+void regular_picks(void) {
+    u32 *cycle = malloc(nnode * sizeof(u32));
+    if (!cycle) fail("out of memory!");
+    u64 rng = rand_stream(RNG_TOPOLOGY, nnode);
+    for (u32 i = 0; i < NOUTBOUND; i++) {
+        // a random order of the nodes (Fisher-Yates)
+        for (u32 j = 0; j < nnode; j++) cycle[j] = j;
+        for (u32 j = nnode - 1; j > 0; j--) {
+            u32 k = randrange(&rng, j + 1);
+            u32 t = cycle[j];
+            cycle[j] = cycle[k];
+            cycle[k] = t;
+        }
+        for (u32 j = 0; j < nnode; j++) {
+            u32 const a = cycle[j], b = cycle[(j + 1) % nnode];
+            // (unless an earlier cycle, or a two-node one, links them)
+            pick[a][i] = picked(a, b, i) || picked(b, a, i + 1) ? NOPEER : b;
+        }
+    }
+    free(cycle);
+}
+
+void scalefree_picks(void) {
+    // Both ends of every link so far, so a node is drawn from this in
+    // proportion to its number of peers.
+    u32 *ends = malloc((u64)nnode * NOUTBOUND * 2 * sizeof(u32));
+    if (!ends) fail("out of memory!");
+    u32 nend = 0;
+    u64 rng = rand_stream(RNG_TOPOLOGY, nnode);
+    for (u32 ni = 0; ni < nnode; ni++) {
+        for (u32 i = 0; i < NOUTBOUND; i++) {
+            if (ni <= NOUTBOUND) {
+                // (the first few link to all the nodes before them)
+                pick[ni][i] = i < ni ? i : NOPEER;
+                continue;
+            }
+            do pick[ni][i] = ends[randrange(&rng, nend)];
+            while (picked(ni, pick[ni][i], i));
+        }
+        for (u32 i = 0; i < NOUTBOUND; i++) {
+            if (pick[ni][i] == NOPEER) continue;
+            ends[nend++] = ni;
+            ends[nend++] = pick[ni][i];
+        }
+    }
+    free(ends);
+}
+
+// With implicit, the links are again NOUTBOUND cycles through all the
+// nodes, but nothing is stored: cycle c visits the nodes in the order
+// implicit_perm(c, 0), implicit_perm(c, 1), ..., a pseudo-random
+// permutation of node index (rounds of add, multiply by an odd number,
+// and xor-shift, modulo nnode, each invertible), so node ni's peers on
+// it are the permutation's values either side of implicit_unperm(c, ni).
+// They're computed whenever they're needed (see node_peers()).
+#define NIMPLICIT (2 * NOUTBOUND)   // (the most peers a node can have)
+#define IMPLICIT_ROUNDS 3
+typedef struct implicit_round_s {
+    u32 add;
+    u32 mul;            // odd
+    u32 mulinv;         // mul * mulinv is 1 (modulo nnode)
+} implicit_round_t;
+implicit_round_t implicit_round[NOUTBOUND][IMPLICIT_ROUNDS];
+u32 implicit_shift;
+
+void implicit_init(void) {
+    u64 rng = rand_stream(RNG_TOPOLOGY, nnode);
+    implicit_shift = (node_shift + 1) / 2;
+    for (u32 c = 0; c < NOUTBOUND; c++) {
+        for (u32 i = 0; i < IMPLICIT_ROUNDS; i++) {
+            implicit_round_t *r = &implicit_round[c][i];
+            r->add = rand_next(&rng);
+            r->mul = rand_next(&rng) | 1;
+            // (Newton's method, each step doubles the correct low bits)
+            r->mulinv = r->mul;
+            for (u32 j = 0; j < 5; j++) r->mulinv *= 2 - r->mul * r->mulinv;
+        }
+    }
+}
+
+u32 implicit_perm(u32 c, u32 x) {
+    for (u32 i = 0; i < IMPLICIT_ROUNDS; i++) {
+        implicit_round_t const *r = &implicit_round[c][i];
+        x = (x + r->add) * r->mul & (nnode - 1);
+        x ^= x >> implicit_shift;
+    }
+    return x;
+}
+
+u32 implicit_unperm(u32 c, u32 x) {
+    for (u32 i = IMPLICIT_ROUNDS; i-- > 0;) {
+        implicit_round_t const *r = &implicit_round[c][i];
+        // (a shift of at least half the bits undoes itself)
+        x ^= x >> implicit_shift;
+        x = (x * r->mulinv - r->add) & (nnode - 1);
+    }
+    return x;
+}
+
+// Node ni's peers, into peer[] (which has room for NIMPLICIT), in order
+// of delay, then index; returns how many.
+u32 implicit_peers(u32 ni, peer_t *peer) {
+    peer_cmp_row = region_link[region[ni]];
+    u32 n = 0;
+    for (u32 c = 0; c < NOUTBOUND; c++) {
+        u32 const r = implicit_unperm(c, ni);
+        for (u32 k = 0; k < 2; k++) {
+            u32 const mi = implicit_perm(c, (k ? r + 1 : r - 1) & (nnode - 1));
+            // (unless an earlier cycle, or a short one, links them)
+            u32 j = n;
+            while (j > 0 && peer[j-1].ni != mi) j--;
+            if (mi == ni || j > 0) continue;
+            // insert it in order
+            peer_t const pp = { mi, 0 };
+            for (j = n++; j > 0; j--) {
+                if (peer_cmp(&peer[j-1], &pp) < 0) break;
+                peer[j] = peer[j-1];
+            }
+            peer[j] = pp;
+        }
+    }
+    return n;
+}
+
+// The peers of np: its peer list, or with implicit, computed into buf
+// (with room for NIMPLICIT), with no heard (it's always 0).
+peer_t *node_peers(node_t *np, peer_t *buf, u32 *npeer) {
+    if (topology != TOPO_IMPLICIT) {
+        *npeer = np->npeer;
+        return np->peer;
+    }
+    *npeer = implicit_peers(np->ni, buf);
+    return buf;
+}
+
+void peer_sort(u32 first, u32 end) {
+    for (u32 ni = first; ni < end; ni++) {
+        peer_cmp_row = region_link[region[ni]];
+        qsort(node[ni].peer, node[ni].npeer, sizeof(peer_t), peer_cmp);
+    }
+}
+
+void topology_init(void) {
+    if (graph_path) {
+        graph_peers();
+        parallel_range(peer_sort);
+        return;
+    }
+    if (topology == TOPO_IMPLICIT) {
+        implicit_init();
+        return;
+    }
+    pick = malloc(nnode * sizeof(*pick));
+    if (!pick) fail("out of memory!");
+    memset(pick, 0xff, nnode * sizeof(*pick));
+    switch (topology) {
+    case TOPO_DISTANCE:
+        parallel_range(distance_picks);
+        distance_fix();
+        break;
+    case TOPO_REGULAR: regular_picks(); break;
+    case TOPO_SCALEFREE: scalefree_picks(); break;
+    }
+    u64 nlink = 0;
+    for (u32 ni = 0; ni < nnode; ni++) {
+        for (u32 i = 0; i < NOUTBOUND; i++) {
+            if (pick[ni][i] == NOPEER) continue;
+            node[ni].npeer++;
+            node[pick[ni][i]].npeer++;
+            nlink++;
+        }
+    }
+    peer_list = calloc(nlink * 2, sizeof(peer_t));
+    if (!peer_list) fail("out of memory!");
+    peer_t *pp = peer_list;
+    for (u32 ni = 0; ni < nnode; ni++) {
+        node[ni].peer = pp;
+        pp += node[ni].npeer;
+        node[ni].npeer = 0;
+    }
+    for (u32 ni = 0; ni < nnode; ni++) {
+        for (u32 i = 0; i < NOUTBOUND; i++) {
+            u32 const peer_mi = pick[ni][i];
+            if (peer_mi == NOPEER) continue;
+            node_t *ppn = &node[peer_mi];
+            node[ni].peer[node[ni].npeer++].ni = peer_mi;
+            ppn->peer[ppn->npeer++].ni = ni;
+        }
+    }
+    free(pick);
+    parallel_range(peer_sort);
+}
+
+// With -o, the nodes are renumbered after the topology is made, so that
+// peers are close together in node[] and the other arrays indexed by
+// node: reverse Cuthill-McKee, a breadth-first order that takes each
+// node's unvisited peers lowest degree first, reversed. A node keeps its
+// original index as its id, which its random streams, the order of
+// simultaneous events, and the results use, and its peers stay in the
+// same order, so the results don't change.
+bool renumber;
+
+int rcm_cmp(void const *a, void const *b) {
+    u32 const na = *(u32 const *)a, nb = *(u32 const *)b;
+    if (node[na].npeer != node[nb].npeer) {
+        return node[na].npeer < node[nb].npeer ? -1 : 1;
+    }
+    return na < nb ? -1 : na > nb;
+}
+
+void node_renumber(void) {
+    u32 *order = malloc(nnode * sizeof(u32));   // by new index, the old
+    u32 *pos = node_index;                      // by old index, the new
+    u64 npeer = 0;
+    for (u32 ni = 0; ni < nnode; ni++) npeer += node[ni].npeer;
+    node_t *newnode = calloc(nnode, sizeof(node_t));
+    peer_t *newpeer = calloc(npeer, sizeof(peer_t));
+    u8 *newregion = malloc(nnode);
+    if (!order || !pos || !newnode || !newpeer || !newregion) {
+        fail("out of memory!");
+    }
+    memset(pos, 0xff, nnode * sizeof(u32));
+    // start from a node of least degree (likely at the graph's edge)
+    u32 first = 0;
+    for (u32 ni = 1; ni < nnode; ni++) {
+        if (node[first].npeer > node[ni].npeer) first = ni;
+    }
+    // order[] is the breadth-first queue; [head, n) are yet to visit
+    u32 n = 0, head = 0;
+    for (u32 k = 0; k <= nnode; k++) {
+        // (then start each other component from its lowest index)
+        u32 const start = k == 0 ? first : k - 1;
+        if (pos[start] != 0xffffffff) continue;
+        pos[start] = n;
+        order[n++] = start;
+        while (head < n) {
+            node_t const *np = &node[order[head++]];
+            u32 const m = n;
+            for (u32 j = 0; j < np->npeer; j++) {
+                u32 const ni = np->peer[j].ni;
+                if (pos[ni] != 0xffffffff) continue;
+                pos[ni] = n;
+                order[n++] = ni;
+            }
+            qsort(&order[m], n - m, sizeof(u32), rcm_cmp);
+        }
+    }
+    // (reversed)
+    for (u32 i = 0; i < nnode; i++) pos[order[i]] = nnode - 1 - i;
+    peer_t *pp = newpeer;
+    for (u32 ni = 0; ni < nnode; ni++) {
+        node_t const *op = &node[order[nnode - 1 - ni]];
+        node_t *np = &newnode[ni];
+        np->id = op->id;
+        np->npeer = op->npeer;
+        np->peer = pp;
+        for (u32 j = 0; j < op->npeer; j++) {
+            pp++->ni = pos[op->peer[j].ni];
+        }
+        newregion[ni] = region[op->id];
+    }
+    free(node);
+    free(peer_list);
+    free(region);
+    free(order);
+    node = newnode;
+    peer_list = newpeer;
+    region = newregion;
+}
+
+// Keep miner[] in order of id, however the nodes are numbered.
+int miner_cmp(void const *a, void const *b) {
+    u32 const ia = node[*(u32 const *)a].id, ib = node[*(u32 const *)b].id;
+    return ia < ib ? -1 : ia > ib;
+}
+
+// Allocate an event that the given node is about to post.
+u32 event_new(node_t *np) {
+    part_t *p = np->part;
+    u32 e = event_alloc(p);
+    event_get(p, e)->src = np->id;
+    event_get(p, e)->seq = np->seq++;
+    return e;
+}
+
+// The delay of np's message with sequence number seq to its peer ni,
+// TIME_NEVER if it's lost. With jitter, messages on a link needn't arrive
+// in the order they were sent: a lower block that's overtaken is left in
+// flight, and dropped as dominated when it arrives.
+simtime_t link_delay(node_t *np, u32 ni, u32 seq) {
+    link_t *lk = &region_link[region[np->ni]][region[ni]];
+    if (!latency_model) return lk->delay;
+    u64 h = latency_key ^ ((u64)np->id << 32 | seq);
+    u64 r = rand_next(&h);
+    if ((r & 0xffff) < lk->loss) return TIME_NEVER;
+    return lk->delay + (simtime_t)(lk->delay * lk->jitter *
+        lat_icdf[r >> (64 - LAT_SHIFT)]);
+}
+
+// Would the node ignore this block from a peer? It does if the block is
+// no better than its tip or than another block that arrived at this instant.
+bool block_dominated(node_t *np, u64 blockid) {
+    return !validblock(blockid) || getheight(blockid) <= node_height[np->ni];
+}
+
+// The tip or arrived block changed, update node_height[].
+void height_update(node_t *np) {
+    u64 height = np->tipheight;
+    if (np->arrived != NOBLOCK && height < getheight(np->arrived)) {
+        height = getheight(np->arrived);
+    }
+    node_height[np->ni] = height;
+}
+
+// The node has all the blocks its peers delivered at this instant; pass
+// the best of them to its thread, unless it's already been beaten (by a
+// block we mined at this instant). There's nothing to do if a rollback
+// undid the deliveries.
+void arrival_notify(part_t *p, u32 e) {
+    node_t *np = &node[event_get(p, e)->ni];
+    event_free(p, e);
+    np->arrival_event = QEND;
+    u64 const blockid = np->arrived;
+    if (blockid == NOBLOCK) return;
+    np->arrived = NOBLOCK;
+    height_update(np);
+    if (block_dominated(np, blockid)) {
+        p->relay.ignored++;
+        return;
+    }
+    if (np->inbox == NOBLOCK || getheight(blockid) > getheight(np->inbox)) {
+        np->inbox = blockid;
+    }
+    pt_signal(p->pt, &np->inbox);
+}
+
+// Peer src, in another partition, sent np this block (see relay()).
+void link_heard(part_t *p, node_t *np, u32 src, u64 blockid) {
+    // (implicit peers have nowhere to keep it)
+    if (topology == TOPO_IMPLICIT) return;
+    u32 pi = 0;
+    while (np->peer[pi].ni != src) pi++;
+    peer_t *pp = &np->peer[pi];
+    u32 const height = getheight(blockid);
+    if (pp->heard >= height) return;
+    if (p->nlog) {
+        // an optimistic rollback must put it back
+        p->log[p->nlog-1].link = pi;
+        p->log[p->nlog-1].heard = pp->heard;
+    }
+    pp->heard = height;
+}
+
+// Relay a newly-discovered block (either we mined or relayed to us).
+// This sends a message to the peer we received the block from (if it's one
+// of our peers), but that's okay, it will be ignored.
+void relay_notify(part_t *p, u32 e) {
+    event_t *ep = event_get(p, e);
+    node_t *np = &node[ep->ni];
+
+    if (!ep->mining) {
+        // From a peer. Several may arrive at the same instant; keep the
+        // best (dispatch dropped the rest), and look at it only after all
+        // of them have arrived.
+        u64 blockid = block_deref(ep->block);
+        u32 const src = node_index[ep->src];
+        if (!part_has(p, src)) link_heard(p, np, src, blockid);
+        if (np->arrival_event != QEND) {
+            np->arrived = blockid;
+            height_update(np);
+            event_free(p, e);
+            return;
+        }
+        // The first one becomes the arrival event (event_post() would
+        // ignore this time).
+        np->arrived = blockid;
+        height_update(np);
+        ep->src = ARRIVAL_SRC;
+        ep->seq = np->id;
+        ep->kind = EV_ARRIVAL;
+        queue_add(p, e);
+        np->arrival_event = e;
+        return;
+    }
+
+    // We mined a block on this one.
+    np->inbox_mined = block_deref(ep->block);
+    event_free(p, e);
+    pt_signal(p->pt, &np->inbox);
+}
+
+void outbox_add(outbox_t *ob, msg_t m) {
+    if (ob->nmsg == ob->nalloc) {
+        ob->nalloc = ob->nalloc ? ob->nalloc * 2 : 64;
+        ob->msg = realloc(ob->msg, ob->nalloc*sizeof(msg_t));
+        if (!ob->msg) fail("out of memory!");
+    }
+    ob->msg[ob->nmsg++] = m;
+}
+
+// Queue a block arrival for a node in another partition.
+void relay_send(node_t *np, u32 ni, u32 seq, simtime_t time) {
+    outbox_add(&np->part->outbox[node[ni].part->pi], (msg_t) {
+        time, np->id, seq, ni, false, np->tip });
+}
+
+// The next of np's peers (in p) that a fanout event should deliver blockid
+// to, after peer[pi] at *time (pi is NOPEER to start), NOPEER if none; *time
+// is set to when. The relay was sent at the given time, with sequence
+// number seq for peer[0]. Peers are reached in order of (time, index);
+// without jitter, that's peer[] order. A peer that would ignore the block
+// now will still ignore it when it gets there (tips only get higher).
+u32 fanout_next(part_t *p, node_t *np, u32 seq, simtime_t sent, u32 pi,
+        simtime_t *time, u64 blockid) {
+    // (a block that's been cleaned away is dominated everywhere)
+    u32 const height = validblock(blockid) ? getheight(blockid) : 0;
+    peer_t buf[NIMPLICIT];
+    u32 npeer;
+    peer_t const *peer = node_peers(np, buf, &npeer);
+    if (!latency_model) {
+        for (pi = pi == NOPEER ? 0 : pi+1; pi < npeer; pi++) {
+            u32 const ni = peer[pi].ni;
+            if (!part_has(p, ni)) continue;
+            if (height > node_height[ni]) {
+                *time = sent + link_delay(np, ni, seq + pi);
+                return pi;
+            }
+            p->relay.coalesced++;
+        }
+        return NOPEER;
+    }
+    // There are few peers, so just look at all of them.
+    while (true) {
+        u32 next = NOPEER;
+        simtime_t next_time = TIME_NEVER;
+        for (u32 i = 0; i < npeer; i++) {
+            if (!part_has(p, peer[i].ni)) continue;
+            simtime_t d = link_delay(np, peer[i].ni, seq + i);
+            if (d == TIME_NEVER) continue;
+            simtime_t t = sent + d;
+            if (pi != NOPEER && (t < *time || (t == *time && i <= pi))) {
+                continue;
+            }
+            if (t < next_time) {
+                next = i;
+                next_time = t;
+            }
+        }
+        if (next == NOPEER) return NOPEER;
+        pi = next;
+        *time = next_time;
+        if (height > node_height[peer[pi].ni]) return pi;
+        p->relay.coalesced++;
+    }
+}
+
+// How a relay reaches the peers in its own partition: with a fanout
+// event each (-f), or with an event per peer (the default). The results
+// are the same.
+bool relay_fanout;
+
+// Send our tip to all our peers. The delivery to peer[pi] has sequence
+// number seq+pi, however it's made. Peers in other partitions are sent
+// messages now. The others are each posted an event now, or with -f, one
+// fanout event delivers to them, nearest first (peer[] is sorted by
+// delay), by being posted again for each.
+void relay(u32 ni) {
+    node_t *np = &node[ni];
+    part_t *p = np->part;
+    u32 const seq = np->seq;
+    peer_t buf[NIMPLICIT];
+    u32 npeer;
+    peer_t const *peer = node_peers(np, buf, &npeer);
+    u32 pi;
+    for (pi = 0; pi < npeer; pi++) {
+        peer_t const *pp = &peer[pi];
+        // (for fanout_next(), which looks at the local peers next)
+        __builtin_prefetch(&node_height[pp->ni]);
+        simtime_t const d = link_delay(np, pp->ni, seq + pi);
+        if (d == TIME_NEVER) {
+            // (fanout_next() skips it)
+            p->relay.lost++;
+            continue;
+        }
+        if (part_has(p, pp->ni)) {
+            if (relay_fanout) continue;
+            if (np->tipheight <= node_height[pp->ni]) {
+                p->relay.coalesced++;
+                continue;
+            }
+            u32 e = event_alloc(p);
+            event_t *ep = event_get(p, e);
+            ep->src = np->id;
+            ep->seq = seq + pi;
+            ep->ni = pp->ni;
+            ep->mining = false;
+            ep->block = block_ref(np->tip);
+            ep->kind = EV_RELAY;
+            p->relay.sent++;
+            event_post(p, e, p->current_time + d);
+            continue;
+        }
+        // Can't look at the peer's state, it's being simulated
+        // concurrently; but its tip is at least as high as any block
+        // it's sent us, so it will ignore the block if it's not better.
+        if (pp->heard >= np->tipheight) {
+            p->relay.coalesced++;
+            continue;
         }
-        heap[i] = heap[next_i];
-        i = next_i;
+        p->relay.sent++;
+        relay_send(np, pp->ni, seq + pi, p->current_time + d);
     }
-    heap[i] = p;
-    return r;
+    np->seq = seq + pi;
+    if (!relay_fanout) return;
+    simtime_t time;
+    u32 const first = fanout_next(p, np, seq, p->current_time, NOPEER, &time,
+        np->tip);
+    if (first == NOPEER) return;
+    u32 e = event_alloc(p);
+    event_t *ep = event_get(p, e);
+    ep->src = np->id;
+    ep->seq = seq + first;
+    ep->ni = first;
+    ep->mining = false;
+    ep->block = block_ref(np->tip);
+    ep->kind = EV_FANOUT;
+    p->relay.sent++;
+    event_post(p, e, time);
 }
 
-u32 event_alloc(void) {
-    if (free_events == event_nalloc) {
-        u32 new_nalloc = event_nalloc * 2;
-        event = realloc(event, new_nalloc*sizeof(event_t));
-        if (!event) fail("out of memory!");
-        heap = realloc(heap, new_nalloc*sizeof(u32));
-        if (!heap) fail("out of memory!");
-        for (u32 i = event_nalloc; i < new_nalloc; i++) {
-            memset(&event[i], 0, sizeof(event_t));
-            event[i].next = i+1;
-        }
-        event_nalloc = new_nalloc;
+// Count this miner as working on its tip block.
+void mining_ref(node_t *np) {
+    block_t *bp = getblock(np->tip);
+    // blocks are shared by all partitions
+    if (__atomic_fetch_add(&bp->active, 1, __ATOMIC_RELAXED) == 0) {
+        __atomic_fetch_add(&ntips, 1, __ATOMIC_RELAXED);
     }
-    u32 r = free_events;
-    free_events = event[free_events].next;
-    return r;
 }
 
-void event_post(u32 e, double time) {
-    event[e].time = time;
-    if (time > current_time) heap_add(e);
-}
+// Network-wide mining (-m global): instead of every miner having its
+// own mining event, which is replaced whenever its tip changes, a single
+// process finds blocks at the total hashrate, and the miner that finds
+// each one is picked in proportion to hashrate. Solve times are
+// exponential (memoryless), so this is the same distribution. There's
+// only ever one mining event queued (in the winner's partition), and
+// it's never superseded.
+bool mining_global;
+u64 mining_rng;
+u32 mining_seq;                     // number of mining events posted
+simtime_t mining_next = TIME_NEVER; // time of the queued mining event
+double *alias_prob;                 // alias table over miner[]
+u32 *alias;
 
-void event_free(u32 i) {
-    memset(&event[i], 0, sizeof(event_t));
-    event[i].next = free_events;
-    free_events = i;
+// Build the alias table (Vose's method) for picking a miner.
+void alias_init(void) {
+    alias_prob = malloc(nminer*sizeof(double));
+    alias = malloc(nminer*sizeof(u32));
+    u32 *small = malloc(nminer*sizeof(u32));
+    u32 *large = malloc(nminer*sizeof(u32));
+    if (!alias_prob || !alias || !small || !large) fail("out of memory!");
+    u32 nsmall = 0, nlarge = 0;
+    for (u32 i = 0; i < nminer; i++) {
+        alias_prob[i] = node[miner[i]].hashrate * nminer / totalhash;
+        alias[i] = i;
+        if (alias_prob[i] < 1) small[nsmall++] = i;
+        else large[nlarge++] = i;
+    }
+    while (nsmall && nlarge) {
+        u32 l = small[--nsmall], g = large[nlarge-1];
+        alias[l] = g;
+        alias_prob[g] -= 1 - alias_prob[l];
+        if (alias_prob[g] < 1) {
+            nlarge--;
+            small[nsmall++] = g;
+        }
+    }
+    // (what's left is 1, but for rounding)
+    while (nlarge) alias_prob[large[--nlarge]] = 1;
+    while (nsmall) alias_prob[small[--nsmall]] = 1;
+    free(small);
+    free(large);
 }
 
-// Return a random value with Poisson distribution with the given average.
-// Useful for block intervals and also network message timings.
-double poisson(double average) {
-    // It may be worth using a better RNG here than the default.
-    return -log(1.0-(double)random()/RAND_MAX)*average;
+// Pick the miner of the next block, and post its mining event.
+void mining_post(simtime_t now) {
+    // uniform in [0,nminer): the integer part picks a column
+    double u = (rand_next(&mining_rng) >> 11) * 0x1p-53 * nminer;
+    u32 i = u;
+    if (i >= nminer) i = nminer - 1;
+    node_t *np = &node[miner[u - i < alias_prob[i] ? i : alias[i]]];
+    // (at least 1 ns, so it's never in a partition's past)
+    simtime_t solvetime = poisson(&mining_rng, block_interval);
+    if (!solvetime) solvetime = 1;
+    part_t *p = np->part;
+    u32 e = event_alloc(p);
+    event_t *ep = event_get(p, e);
+    ep->src = MINING_SRC;
+    ep->seq = mining_seq++;
+    ep->ni = np->ni;
+    ep->mining = true;
+    ep->kind = EV_MINE;
+    // (event_post() would ignore this if p is behind)
+    ep->time = mining_next = now + solvetime;
+    queue_add(p, e);
 }
 
-typedef struct peer_s {
-    u32 ni;
-    double delay;
-} peer_t;
-
-#define NPEER 100
+// A network-wide mining event: the miner finds a block on its tip.
+void mine_notify(part_t *p, u32 e) {
+    event_t *ep = event_get(p, e);
+    node_t *np = &node[ep->ni];
+    simtime_t const now = ep->time;
+    event_free(p, e);
+    mining_post(now);
+    np->inbox_mined = np->tip;
+    pt_signal(p->pt, &np->inbox);
+}
 
-typedef struct node_s {
-    pt_thread_t pt_thread;
-    pt_func_t pt_func;
-    u32 ni;             // my node index
-    u32 qhead;          // event input message queue, -1 means empty
-    u32 delay_event;    // event index
-    u64 tip;            // blockid of best block *we* know about
-    double hashrate;
-    u64 mined;          // how many total blocks we've mined (including reorg)
-    u64 credit;         // how many best-chain blocks we've mined
-    peer_t peer[NPEER]; // maybe make this variable-length?
-} node_t;
+// Start mining on top of the given existing block
+void start_mining(node_t *np) {
+    part_t *p = np->part;
+    mining_ref(np);
+    if (mining_global) return;
 
-#define QHEAD_EMPTY 0xffffffff
+    // Our previous mining event (if it's still queued) is superseded.
+    if (np->mining_event != QEND) {
+        u32 old = np->mining_event;
+        queue_remove(p, old);
+        // an optimistic rollback must put it back
+        if (p->nlog) p->log[p->nlog-1].mining = *event_get(p, old);
+        event_free(p, old);
+        p->nremoved++;
+    }
 
-// later there will be a dynamic set of nodes
-u32 node_shift; // for now only 8 nodes
-u32 nnode;      // must be even, 32k for now
-node_t *node;
-u32 nminer;
-u32 *miner;
+    // Schedule an event for when our "mining" will be done.
+    simtime_t solvetime = poisson(&np->rng,
+        block_interval * totalhash / np->hashrate);
+    // (at least 1 ns, else event_post() wouldn't queue it, and the next
+    // start_mining() would remove an event that isn't in the queue)
+    if (!solvetime) solvetime = 1;
 
-void node_init(void) {
-    node_shift = 15; // for now 32k nodes
-    nnode = 1 << node_shift;
-    node = calloc(nnode, sizeof(node_t));
-    miner = calloc(nnode, sizeof(u32));
+    u32 e = event_new(np);
+    event_t *ep = event_get(np->part, e);
+    ep->ni = np->ni;
+    ep->mining = true;
+    ep->block = block_ref(np->tip);
+    ep->kind = EV_RELAY;
+    // TODO jitter this delay, or sometimes fail to forward?
+    event_post(np->part, e, np->part->current_time + solvetime);
+    np->mining_event = e;
+    if(0) printf("%.3f %03d start-on %llu height %llu "
+            "mined %lld credit %lld solve %.2f\n",
+        time_sec(np->part->current_time), np->ni, np->tip,
+        getheight(np->tip), np->mined, np->credit, time_sec(solvetime));
 }
 
-// Relay a newly-discovered block (either we mined or relayed to us).
-// This sends a message to the peer we received the block from (if it's one
-// of our peers), but that's okay, it will be ignored.
-void relay_notify(protothread_t pt, u32 e) {
-    event_t *ep = &event[e];
-    node_t *np = &node[ep->u.new_block.ni];
-
-    // link to list of incoming block notify messages
-    ep->next = np->qhead;
-    np->qhead = e;
-
-    pt_signal(pt, &np->qhead);
+void stop_mining(node_t *np) {
+    block_t *bp = getblock(np->tip);
+    if (__atomic_sub_fetch(&bp->active, 1, __ATOMIC_RELAXED) == 0) {
+        __atomic_fetch_sub(&ntips, 1, __ATOMIC_RELAXED);
+    }
 }
 
-void relay(u32 ni) {
-    node_t *np = &node[ni];
-    for (u32 pi = 0; pi < NPEER; pi++) {
-        peer_t *pp = &np->peer[pi];
-        if (pp->delay == 0) continue;
-        // Improve simulator efficiency by not relaying blocks
-        // that are certain to be ignored.
-        node_t *ppn = &node[pp->ni];
-        if (!validblock(ppn->tip) ||
-                getheight(ppn->tip) < getheight(np->tip)) {
-            u32 e = event_alloc();
-            event_t *ep = &event[e];
-            ep->u.new_block.ni = ppn->ni;
-            ep->u.new_block.mining = false;
-            ep->u.new_block.blockid = np->tip;
-            ep->notify = relay_notify;
-            // TODO jitter this delay, or sometimes fail to forward?
-            event_post(e, current_time + pp->delay);
+// A miner's tip moves from one block to another: the blocks back to where
+// the branches meet are no longer under its tip, or now are (usually just
+// the new tip). A block is final once it's under every miner's tip.
+void tip_move(u64 from, u64 to) {
+    while (from != to) {
+        block_t *fp = getblock(from), *tp = getblock(to);
+        if (fp->height >= tp->height) {
+            __atomic_fetch_sub(&fp->ntip, 1, __ATOMIC_RELAXED);
+            from = fp->parent;
+        }
+        if (tp->height >= fp->height) {
+            __atomic_fetch_add(&tp->ntip, 1, __ATOMIC_RELAXED);
+            to = tp->parent;
         }
     }
 }
 
-// Start mining on top of the given existing block
-void start_mining(node_t *np) {
-    block_t *bp = getblock(np->tip);
-    if (bp->active++ == 0) ntips++;
+// Will dispatching this event create a block? (Stale mining events don't.)
+bool event_mines(event_t *ep) {
+    return ep->kind == EV_MINE || (ep->kind == EV_RELAY && ep->mining &&
+        block_deref(ep->block) == node[ep->ni].tip);
+}
 
-    // Schedule an event for when our "mining" will be done.
-    double solvetime = poisson(300 * totalhash / np->hashrate);
-
-    u32 e = event_alloc();
-    event_t *ep = &event[e];
-    ep->u.new_block.ni = np->ni;
-    ep->u.new_block.mining = true;
-    ep->u.new_block.blockid = np->tip;
-    ep->notify = relay_notify;
-    // TODO jitter this delay, or sometimes fail to forward?
-    event_post(e, current_time + solvetime);
-    if(0) printf("%.3f %03d start-on %llu height %llu "
-            "mined %lld credit %lld solve %.2f\n",
-        current_time, np->ni, np->tip, getheight(np->tip),
-        np->mined, np->credit, solvetime);
+// Would the node ignore this event? Then it needn't be delivered. These
+// are relays of dominated blocks (and stale mining events, but
+// start_mining() removes those).
+bool event_dominated(event_t *ep) {
+    if (ep->kind != EV_RELAY) return false;
+    node_t *np = &node[ep->ni];
+    u64 blockid = block_deref(ep->block);
+    if (ep->mining) return blockid != np->tip;
+    return block_dominated(np, blockid);
 }
 
-void stop_mining(node_t *np) {
-    block_t *bp = getblock(np->tip);
-    if (--bp->active == 0) ntips--;
+// The node that a fanout event delivers to next.
+node_t *fanout_dest(event_t *ep) {
+    peer_t buf[NIMPLICIT];
+    u32 npeer;
+    peer_t const *peer = node_peers(&node[node_index[ep->src]], buf, &npeer);
+    return &node[peer[ep->ni].ni];
+}
+
+// Deliver a relayed block to the next peer (unless it's dominated there),
+// and post the fanout again for the peer after that.
+void fanout_notify(part_t *p, u32 e) {
+    event_t *ep = event_get(p, e);
+    node_t *np = &node[node_index[ep->src]];
+    node_t *dp = fanout_dest(ep);
+    if (block_dominated(dp, block_deref(ep->block))) {
+        p->relay.ignored++;
+    } else {
+        // (events don't move, ep stays valid)
+        u32 d = event_alloc(p);
+        event_t *dep = event_get(p, d);
+        *dep = *ep;
+        dep->ni = dp->ni;
+        dep->kind = EV_RELAY;
+        relay_notify(p, d);
+    }
+    u32 const seq = ep->seq - ep->ni;
+    simtime_t const sent = ep->time - link_delay(np, dp->ni, ep->seq);
+    simtime_t time = ep->time;
+    u32 pi = fanout_next(p, np, seq, sent, ep->ni, &time,
+        block_deref(ep->block));
+    if (pi == NOPEER) {
+        if (!p->keep_fanouts) event_free(p, e);
+        return;
+    }
+    ep->seq = seq + pi;
+    ep->ni = pi;
+    ep->time = time;
+    p->relay.sent++;
+    queue_add(p, e);
 }
 
-void delay_notify(protothread_t pt, u32 e) {
-    pt_signal(pt, &node[event[e].u.delay.ni].delay_event);
+void delay_notify(part_t *p, u32 e) {
+    pt_signal(p->pt, &node[event_get(p, e)->ni].delay_event);
 }
+
+// by event kind
+void (* const notify[])(part_t *, u32) = {
+    [EV_DELAY] = delay_notify,
+    [EV_RELAY] = relay_notify,
+    [EV_ARRIVAL] = arrival_notify,
+    [EV_FANOUT] = fanout_notify,
+    [EV_MINE] = mine_notify,
+};
 // This could be a (proto)function, but then it would need its own
 // thread context. Not hard, but this is easier for now at least.
 #define delay(np, time) do { \
-    np->delay_event = event_alloc(); \
-    event_t *ep = &event[np->delay_event]; \
-    ep->u.delay.ni = np->ni; \
-    ep->notify = delay_notify; \
-    event_post(np->delay_event, current_time + time); \
-    while (event_pending(np->delay_event)) pt_wait(np, &np->delay_event); \
-    event_free(np->delay_event); \
+    np->delay_event = event_new(np); \
+    event_t *ep = event_get(np->part, np->delay_event); \
+    ep->ni = np->ni; \
+    ep->kind = EV_DELAY; \
+    event_post(np->part, np->delay_event, np->part->current_time + time); \
+    while (event_pending(np->part, np->delay_event)) \
+        pt_wait(np, &np->delay_event); \
+    event_free(np->part, np->delay_event); \
 } while (false)
 
 pt_t node_thr(env_t const env) {
     node_t * const np = env;
     u32 const ni = np->ni;
     pt_resume(np);
-    //np->is_miner = (randrange(10) == 0);
-    // make 10 outbound connections
-    u32 pi = 0;
-    for (u32 i = 0; i < 2; i++) {
-        // find an available local slot
-        while (pi < NPEER && np->peer[pi].delay > 0) pi++;
-        if (pi >= NPEER) break;
-
-        // perfer nodes that are "close" to us
-        u32 d, peer_mi, ppi;
-        while (true) {
-            d = 1 + randrange(1 << randrange(node_shift + 1));
-            peer_mi = (ni + d) % nnode;
-
-            // see if this peer is already in our peer list
-            u32 j = 0;
-            for (j = 0; j < NPEER; j++) {
-                if (np->peer[j].delay > 0 && np->peer[j].ni == peer_mi) break;
-            }
-            if (j < NPEER) continue;
-
-            // find an available peer slot
-            for (ppi = 0; ppi < NPEER; ppi++) {
-                if (node[peer_mi].peer[ppi].delay == 0) break;
-            }
-            if (ppi < NPEER) break;
-        }
-        np->peer[pi].ni = peer_mi;
-        // one hop away is 100 ms
-        np->peer[pi].delay = (double)d * 100 / 1000;
-        // make it bidirectional
-        node[peer_mi].peer[ppi].ni = ni;
-        node[peer_mi].peer[ppi].delay = np->peer[pi].delay;
-    }
-    totalhash += np->hashrate;
     np->tip = baseblockid;
+    np->tipheight = 0;
     if (np->hashrate > 0) start_mining(np);
     while (true) {
-        double delay_time = ni*20;
+        simtime_t delay_time = ni*20*SECOND;
         if(0) printf("thr %i time %f wakeat %f\n",
-            ni, current_time, current_time+delay_time);
+            ni, time_sec(np->part->current_time),
+            time_sec(np->part->current_time+delay_time));
         if(0) delay(np, delay_time);
         // wait for a block to arrive
-        while (np->qhead == QHEAD_EMPTY) pt_wait(np, &np->qhead);
-        u32 const ei = np->qhead;
-        event_t *ep = &event[np->qhead];
-        np->qhead = ep->next;
-        u64 blockid = ep->u.new_block.blockid;
-        bool mining = ep->u.new_block.mining;
-        event_free(ei);
+        while (np->inbox == NOBLOCK && np->inbox_mined == NOBLOCK) {
+            pt_wait(np, &np->inbox);
+        }
+        bool const mining = np->inbox_mined != NOBLOCK;
+        u64 blockid;
+        if (mining) {
+            blockid = np->inbox_mined;
+            np->inbox_mined = NOBLOCK;
+        } else {
+            blockid = np->inbox;
+            np->inbox = NOBLOCK;
+        }
         if (mining) {
             assert(np->hashrate > 0);
             // We mined a block (unless this is a stale event).
@@ -370,151 +2482,872 @@ pt_t node_thr(env_t const env) {
                 // still have an active mining event outstanding).
                 continue;
             }
+            np->mining_event = QEND;   // (this one)
             np->mined++;
             stop_mining(np);
-            blockid = baseblockid + nblock;
-            u32 bi = block_alloc();
-            block_t *bp = &block[bi];
+            blockid = block_alloc();
+            block_t *bp = getblock(blockid);
             bp->parent = np->tip;
-            bp->height = getheight(np->tip) + 1;
+            bp->height = np->tipheight + 1;
             bp->miner = ni;
+            u64 const sh = block_skip_height(bp->height);
+            bp->skip = sh < getheight(baseblockid) ? NOBLOCK :
+                block_ancestor(np->tip, sh);
         } else {
             // Block received from a peer (but could be a stale message).
             if (!validblock(blockid)) {
                 // We're already mining on a block that's at least as good.
                 continue;
             }
-            if (validblock(np->tip) &&
-                    getheight(blockid) <= getheight(np->tip)) {
+            if (getheight(blockid) <= np->tipheight) {
                 // We're already mining on a block that's at least as good.
                 continue;
             }
             // This block is better, switch to it, first compute reorg depth.
             if(np->hashrate > 0) if(0) printf("%.3f %i received-switch-to %llu\n",
-                current_time, ni, blockid);
+                time_sec(np->part->current_time), ni, blockid);
             if (np->hashrate > 0) stop_mining(np);
 
             // update reorg statistics
             if (np->hashrate > 0) {
-                block_t *c = getblock(np->tip);
-                block_t *t = getblock(blockid); // to block (switching to)
-                // Move back on the "to" (better) chain until even with tip.
-                while (t->height > c->height) {
-                    t = getblock(t->parent);
-                }
-                // From the same height, count blocks until these branches meet.
-                u32 reorg = 0;
-                while (t != c) {
-                    reorg++;
-                    t = getblock(t->parent);
-                    c = getblock(c->parent);
-                }
+                // the blocks we're abandoning, back to where the
+                // branches meet
+                u64 const fork = block_fork(np->tip, blockid);
+                assert(fork == block_fork_walk(np->tip, blockid));
+                u32 reorg = np->tipheight - getheight(fork);
                 if (reorg > 0) {
                     if(0) printf("%.3f %i reorg %d maxreorg %d\n",
-                        current_time, ni, reorg, maxreorg);
+                        time_sec(np->part->current_time), ni, reorg,
+                        np->maxreorg);
                 }
-                if (maxreorg < reorg) {
-                    maxreorg = reorg;
+                if (np->maxreorg < reorg) {
+                    np->maxreorg = reorg;
                 }
             }
         }
+        if (np->hashrate > 0) tip_move(np->tip, blockid);
         np->tip = blockid;
+        np->tipheight = getheight(blockid);
+        height_update(np);
         relay(ni);
         if (np->hashrate > 0) start_mining(np);
     }
     return PT_DONE;
 }
 
+// With -a, the blocks that cleaning releases are appended to an archive
+// file (see archive.h), through a mapping that grows in large steps.
+#define ARCHIVE_GROW ((u64)64 << 20)
+int archive_fd = -1;
+u8 *archive_map;
+u64 archive_len;        // bytes written
+u64 archive_size;       // bytes mapped (and the file's size, until closed)
+
+void archive_append(void const *data, u32 len) {
+    if (archive_len + len > archive_size) {
+        if (archive_map) munmap(archive_map, archive_size);
+        archive_size += ARCHIVE_GROW;
+        if (ftruncate(archive_fd, archive_size)) fail("can't extend archive");
+        archive_map = mmap(NULL, archive_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED, archive_fd, 0);
+        if (archive_map == MAP_FAILED) fail("can't map archive");
+    }
+    memcpy(archive_map + archive_len, data, len);
+    archive_len += len;
+}
+
+void archive_open(char const *path) {
+    archive_fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (archive_fd < 0) fail("can't create archive");
+    archive_header_t h = { ARCHIVE_MAGIC, ARCHIVE_VERSION,
+        sizeof(archive_record_t), seed, nnode };
+    archive_append(&h, sizeof(h));
+}
+
+// Archive the blocks from baseblockid up to (not including) end. A block
+// is final if it's under every miner's tip; otherwise it's orphaned if
+// it's older than the newest final block, else pending.
+void archive_blocks(u64 end, u64 final) {
+    if (archive_fd < 0) return;
+    for (u64 b = baseblockid; b < end; b++) {
+        block_t *bp = getblock(b);
+        // (no one mined the first block)
+        u32 const id = bp->height ? node[bp->miner].id : 0;
+        archive_record_t r = { b, bp->parent, bp->height, id,
+            bp->ntip == nminer ? ARC_FINAL :
+            b < final ? ARC_ORPHAN : ARC_PENDING };
+        archive_append(&r, sizeof(r));
+    }
+}
+
+void archive_close(void) {
+    if (archive_fd < 0) return;
+    archive_blocks(baseblockid + nblock, baseblockid);
+    munmap(archive_map, archive_size);
+    if (ftruncate(archive_fd, archive_len)) fail("can't truncate archive");
+    close(archive_fd);
+}
+
 // Remove unneded blocks, give credits to miners.
 void clean_blocks(void) {
-    u64 minheight = 0;
-    for (u32 i = 0; i < nminer; i++) {
-        u64 h = getheight(node[miner[i]].tip);
-        if (i == 0 || minheight > h) minheight = h;
+    // Find the newest block that all tips are based on (oldest branch
+    // point); it's under any one of them, at most as far back as the
+    // blocks that have been mined since the last clean.
+    u64 newbaseblockid = node[miner[0]].tip;
+    while (getblock(newbaseblockid)->ntip < nminer) {
+        newbaseblockid = getblock(newbaseblockid)->parent;
     }
 
-    // move down all tips until they're at the same (minimum) height
-    u64 *tip = calloc(nminer, sizeof(u64));
-    for (u32 i = 0; i < nminer; i++) {
-        node_t *np = &node[miner[i]];
-        tip[i] = np->tip;
-        while (getheight(tip[i]) > minheight) {
-            tip[i] = getblock(tip[i])->parent;
+    // Give credits to miners (these blocks can't be reorged away).
+    for (u64 b = newbaseblockid; b != baseblockid; b = getblock(b)->parent) {
+        node[getblock(b)->miner].credit++;
+    }
+
+    // Remove older blocks that are no longer relevant, a chunk at a time.
+    archive_blocks(newbaseblockid, newbaseblockid);
+    nblock -= (newbaseblockid - baseblockid);
+    baseblockid = newbaseblockid;
+    while (firstchunk < baseblockid >> BLOCK_SHIFT) {
+        block_t *chunk = blockchunk[firstchunk++ & (nchunk_alloc-1)];
+        if (block_spare) free(block_spare);
+        block_spare = chunk;
+    }
+}
+
+// Clean once there are clean_at blocks. If that doesn't free much (the
+// miners' tips are far apart), wait until there are twice as many, so
+// the tips aren't walked back over the same blocks every time.
+u32 clean_at = BLOCK_CHUNK;
+
+void clean_maybe(void) {
+    if (nblock < clean_at) return;
+    clean_blocks();
+    clean_at = nblock + BLOCK_CHUNK;
+    if (clean_at < 2*nblock) clean_at = 2*nblock;
+}
+
+// Blocks are cleaned only at multiples of this (simulated) interval, when
+// every partition has dispatched exactly the events before that time;
+// cleaning makes messages carrying old blocks stale, so its timing must
+// not depend on the partitioning.
+#define CLEAN_INTERVAL (60*SECOND)
+
+u64 maxevent = 80*1000*1000;    // stop after dispatching this many events
+simtime_t endtime = TIME_NEVER; // or when simulated time reaches this
+simtime_t clean_time = CLEAN_INTERVAL;
+
+// Dispatch the next event, and run the threads it makes runnable; return
+// false if the event was dropped instead. With batch, the arrival events
+// that end the instant are all dispatched, and then the threads run once.
+bool part_dispatch(part_t *p, bool batch) {
+    u32 e = queue_pop(p);
+    event_t *ep = event_get(p, e);
+    p->current_time = ep->time;
+    if (event_dominated(ep)) {
+        event_free(p, e);
+        p->relay.ignored++;
+        return false;
+    }
+    p->nevent++;
+    bool arrival = ep->kind == EV_ARRIVAL;
+    notify[ep->kind](p, e); // should make a thread runnable
+    while (batch && arrival && p->nqueue) {
+        e = queue_first(p);
+        ep = event_get(p, e);
+        if (ep->kind != EV_ARRIVAL || ep->time != p->current_time) {
+            break;
+        }
+        queue_pop(p);
+        p->nevent++;
+        notify[ep->kind](p, e);
+    }
+    while (protothread_run(p->pt));
+    return true;
+}
+
+// Dispatch the events that fire before time end. In parallel mode, stop
+// at the first event that creates a block; blocks must be created in the
+// same order as a serial run since block ids are sequential.
+void part_run(part_t *p, simtime_t end, bool parallel) {
+    p->stall = false;
+    while (p->nqueue && p->nevent < maxevent) {
+        event_t *ep = event_get(p, queue_first(p));
+        if (ep->time >= end) break;
+        if (parallel && event_mines(ep)) {
+            p->stall = true;
+            break;
+        }
+        part_dispatch(p, true);
+    }
+}
+
+// Move the messages other partitions sent us into our queue.
+void part_receive(part_t *p) {
+    for (u32 i = 0; i < npart; i++) {
+        outbox_t *ob = &part[i].outbox[p->pi];
+        for (u32 j = 0; j < ob->nmsg; j++) {
+            msg_t *m = &ob->msg[j];
+            u32 e = event_alloc(p);
+            event_t *ep = event_get(p, e);
+            ep->src = m->src;
+            ep->seq = m->seq;
+            ep->ni = m->ni;
+            ep->mining = false;
+            ep->block = block_ref(m->blockid);
+            ep->kind = EV_RELAY;
+            event_post(p, e, m->time);
+        }
+        ob->nmsg = 0;
+    }
+}
+
+// Time of the earliest pending event over all partitions.
+simtime_t next_time(void) {
+    simtime_t t = TIME_NEVER;
+    for (u32 i = 0; i < npart; i++) {
+        part_t *p = &part[i];
+        if (p->nqueue && t > event_get(p, queue_first(p))->time) {
+            t = event_get(p, queue_first(p))->time;
+        }
+    }
+    return t;
+}
+
+u64 total_events(void) {
+    u64 n = 0;
+    for (u32 i = 0; i < npart; i++) n += part[i].nevent;
+    return n;
+}
+
+void sim_serial(void) {
+    part_t *p = &part[0];
+    while (true) {
+        part_run(p, time_min(clean_time, endtime), false);
+        if (p->nevent >= maxevent) break;
+        simtime_t t = next_time();
+        if (t >= endtime) break;
+        if (t >= clean_time) {
+            clean_maybe();
+            clean_time += CLEAN_INTERVAL;
         }
     }
-    // Find the block that all tips are based on (oldest branch point).
+}
+
+// Conservative parallel simulation: every partition runs on its own
+// thread. Events that send messages to another partition fire at least
+// lookahead (the smallest delay on any link that crosses partitions)
+// before the messages arrive, so each partition can independently
+// dispatch all its events within lookahead of the earliest pending event.
+simtime_t lookahead;
+simtime_t window_end;   // partitions dispatch events before this time
+u64 nwindow;            // number of windows (each two barrier rounds)
+pthread_barrier_t barrier;
+
+// What the partition threads do next.
+enum part_cmd_e {
+    CMD_RUN,        // dispatch events before window_end
+    CMD_RECEIVE,    // move other partitions' messages into our queue
+    CMD_OPTIMISTIC, // speculatively dispatch events before window_end
+    CMD_GATHER,     // take other partitions' messages (optimistic)
+    CMD_APPLY,      // roll back and annihilate as they require
+    CMD_QUIT,
+} part_cmd;
+
+void tw_run(part_t *p, simtime_t end);
+void tw_gather(part_t *p);
+void tw_apply(part_t *p);
+
+void *part_thread(void *arg) {
+    part_t *p = arg;
     while (true) {
-        u32 i;
-        for (i = 1; i < nminer; i++) {
-            if (tip[i] != tip[0]) break;
+        pthread_barrier_wait(&barrier);
+        switch (part_cmd) {
+        case CMD_RUN: part_run(p, window_end, true); break;
+        case CMD_RECEIVE: part_receive(p); break;
+        case CMD_OPTIMISTIC: tw_run(p, window_end); break;
+        case CMD_GATHER: tw_gather(p); break;
+        case CMD_APPLY: tw_apply(p); break;
+        case CMD_QUIT: return NULL;
         }
-        if (i >= nminer) break;
-        for (i = 0; i < nminer; i++) {
-            tip[i] = getblock(tip[i])->parent;
+        pthread_barrier_wait(&barrier);
+    }
+}
+
+// Have every partition thread carry out the command, wait until they have.
+void part_command(enum part_cmd_e cmd) {
+    part_cmd = cmd;
+    pthread_barrier_wait(&barrier);
+    if (cmd != CMD_QUIT) pthread_barrier_wait(&barrier);
+}
+
+void part_threads_start(void) {
+    lookahead = TIME_NEVER;
+    for (u32 ni = 0; ni < nnode; ni++) {
+        peer_t buf[NIMPLICIT];
+        u32 npeer;
+        peer_t const *peer = node_peers(&node[ni], buf, &npeer);
+        for (u32 j = 0; j < npeer; j++) {
+            if (node[peer[j].ni].part == node[ni].part) continue;
+            simtime_t d = region_link[region[ni]][region[peer[j].ni]].delay;
+            if (lookahead > d) lookahead = d;
         }
     }
-    u64 newbaseblockid = tip[0];
+    pthread_barrier_init(&barrier, NULL, npart + 1);
+    for (u32 i = 0; i < npart; i++) {
+        pthread_create(&part[i].thread, NULL, part_thread, &part[i]);
+    }
+}
 
-    // Give credits to miners (these blocks can't be reorged away).
-    block_t *bp = getblock(newbaseblockid);
-    while (bp != &block[0]) {
-        node[bp->miner].credit++;
-        bp = getblock(bp->parent);
+void part_threads_stop(void) {
+    part_command(CMD_QUIT);
+    for (u32 i = 0; i < npart; i++) {
+        pthread_join(part[i].thread, NULL);
     }
+    pthread_barrier_destroy(&barrier);
+}
 
-    // Remove older blocks that are no longer relevant.
-    nblock -= (newbaseblockid - baseblockid);
-    block_nalloc = nblock;
-    while (block_nalloc & (block_nalloc-1)) block_nalloc++;
-    block_t *newblock = calloc(block_nalloc, sizeof(block_t));
-    for (u32 i = 0; i < nblock; i++) {
-        newblock[i] = block[i + newbaseblockid - baseblockid];
-    }
-    free(block);
-    block = newblock;
-    baseblockid = newbaseblockid;
-    free(tip);
+// The partition (if any) whose next event is the earliest of those
+// that satisfy stalled (all partitions if not).
+part_t *earliest_part(bool stalled) {
+    part_t *sp = NULL;
+    for (u32 i = 0; i < npart; i++) {
+        part_t *p = &part[i];
+        if (!p->nqueue || (stalled && !p->stall)) continue;
+        if (!sp || event_before(event_get(p, queue_first(p)),
+                event_get(sp, queue_first(sp)))) {
+            sp = p;
+        }
+    }
+    return sp;
 }
 
+void sim_parallel(void) {
+    part_threads_start();
+    while (total_events() < maxevent) {
+        simtime_t t = next_time();
+        if (t >= endtime) break;
+        if (t >= clean_time) {
+            clean_maybe();
+            clean_time += CLEAN_INTERVAL;
+            continue;
+        }
+        window_end = time_min(time_min(time_add(t, lookahead), clean_time),
+            time_min(endtime, time_add(mining_next, 1)));
+        part_command(CMD_RUN);
+        part_command(CMD_RECEIVE);
+        nwindow++;
 
-int main(void) {
-    {
-        static char rngstate[256];
-        initstate(0 /*time(0)*/, rngstate, sizeof(rngstate));
+        // Create the earliest block (only this partition is running).
+        part_t *sp = earliest_part(true);
+        if (sp) {
+            part_dispatch(sp, true);
+            for (u32 i = 0; i < npart; i++) part_receive(&part[i]);
+        }
+    }
+    part_threads_stop();
+}
+
+// Optimistic (Time Warp) parallel simulation: partitions dispatch events
+// up to optimism seconds beyond the global virtual time (GVT, the time
+// of the earliest pending event anywhere) without waiting for messages
+// from other partitions. A message that arrives in a partition's past (a
+// straggler) rolls the partition back: the events after it are undone by
+// restoring the saved node state and are queued again, and the messages
+// they posted are annihilated, locally or by anti-messages to other
+// partitions (which may roll those back in turn). A block is created only
+// once its mining event is the GVT event, so blocks are never undone.
+simtime_t optimism; // time ahead of GVT, 0 means conservative
+
+void node_save(node_t *np, nstate_t *s) {
+    *s = (nstate_t) { np->tip, np->tipheight, np->rng, np->mined,
+        np->seq, np->maxreorg, np->arrived, np->inbox, np->inbox_mined };
+}
+
+void node_restore(node_t *np, nstate_t *s) {
+    if (np->hashrate > 0 && np->tip != s->tip) {
+        stop_mining(np);
+        tip_move(np->tip, s->tip);
+        np->tip = s->tip;
+        mining_ref(np);
+    }
+    np->tip = s->tip;
+    np->tipheight = s->tipheight;
+    np->rng = s->rng;
+    np->mined = s->mined;
+    np->seq = s->seq;
+    np->maxreorg = s->maxreorg;
+    np->arrived = s->arrived;
+    np->inbox = s->inbox;
+    np->inbox_mined = s->inbox_mined;
+    height_update(np);
+}
+
+// Dispatch the next event, saving what's needed to undo it.
+void tw_dispatch(part_t *p) {
+    if (p->nlog == p->log_nalloc) {
+        p->log_nalloc = p->log_nalloc ? p->log_nalloc * 2 : 1024;
+        p->log = realloc(p->log, p->log_nalloc*sizeof(twlog_t));
+        if (!p->log) fail("out of memory!");
+    }
+    twlog_t *lg = &p->log[p->nlog++];
+    u32 const e = queue_first(p);
+    lg->ev = *event_get(p, e);
+    bool const fanout = lg->ev.kind == EV_FANOUT;
+    lg->ni = fanout ? fanout_dest(&lg->ev)->ni : lg->ev.ni;
+    node_save(&node[lg->ni], &lg->before);
+    lg->mining.kind = EV_NONE;
+    lg->relay = p->relay;
+    lg->link = NOPEER;
+    lg->dropped = !part_dispatch(p, false);
+    if (fanout) {
+        // (fanout_notify() posts it again with the next seq, if any)
+        lg->fanout = e;
+        lg->finished = event_get(p, e)->seq == lg->ev.seq;
+    }
+}
+
+void tw_run(part_t *p, simtime_t end) {
+    while (p->nqueue) {
+        event_t *ep = event_get(p, queue_first(p));
+        if (ep->time >= end) break;
+        // wait until this is the GVT event
+        if (event_mines(ep)) break;
+        tw_dispatch(p);
+    }
+}
+
+void tw_cancel_add(part_t *p, u32 src, u32 seq) {
+    if (p->ncancel == p->cancel_nalloc) {
+        p->cancel_nalloc = p->cancel_nalloc ? p->cancel_nalloc * 2 : 64;
+        p->cancel = realloc(p->cancel, p->cancel_nalloc*sizeof(cancel_t));
+        if (!p->cancel) fail("out of memory!");
+    }
+    p->cancel[p->ncancel++] = (cancel_t) { src, seq };
+}
+
+// Undo the dispatched events that aren't before k, and queue them again.
+// The nodes they changed are marked as rolled; the events those nodes
+// posted since their restored state must then be annihilated.
+void tw_rollback(part_t *p, event_t *k) {
+    if (!p->nlog || event_before(&p->log[p->nlog-1].ev, k)) return;
+    p->nrollback++;
+    while (p->nlog && !event_before(&p->log[p->nlog-1].ev, k)) {
+        twlog_t *lg = &p->log[--p->nlog];
+        node_t *np = &node[lg->ni];
+        node_restore(np, &lg->before);
+        // If the node had no arrival pending then, its queued arrival
+        // event goes: the relay that posted it has been rolled back (and
+        // will post it again, unless it's cancelled or arrives earlier).
+        if (np->arrived == NOBLOCK && np->arrival_event != QEND) {
+            queue_remove(p, np->arrival_event);
+            event_free(p, np->arrival_event);
+            np->arrival_event = QEND;
+        }
+        if (!np->rolled) {
+            np->rolled = true;
+            tw_cancel_add(p, np->id, 0);
+        }
+        if (lg->mining.kind != EV_NONE) {
+            u32 e = event_alloc(p);
+            *event_get(p, e) = lg->mining;
+            queue_add(p, e);
+            np->mining_event = e;
+            p->nremoved--;
+        }
+        if (lg->ev.kind == EV_FANOUT) {
+            // it's the same event, posted again unless it finished
+            if (!lg->finished) queue_remove(p, lg->fanout);
+            *event_get(p, lg->fanout) = lg->ev;
+            queue_add(p, lg->fanout);
+        } else {
+            u32 e = event_alloc(p);
+            *event_get(p, e) = lg->ev;
+            queue_add(p, e);
+            if (lg->ev.kind == EV_ARRIVAL) np->arrival_event = e;
+        }
+        if (lg->link != NOPEER) np->peer[lg->link].heard = lg->heard;
+        p->relay = lg->relay;
+        if (!lg->dropped) p->nundone++;
+    }
+    p->current_time = p->nlog ? p->log[p->nlog-1].ev.time : p->commit_time;
+}
+
+int cancel_cmp(void const *a, void const *b) {
+    cancel_t const *ca = a, *cb = b;
+    if (ca->src != cb->src) return ca->src < cb->src ? -1 : 1;
+    return ca->seq < cb->seq ? -1 : ca->seq > cb->seq;
+}
+
+// Sort the first n cancel entries by src, keeping one (the lowest seq)
+// per src; return the new count.
+u32 cancel_sort(cancel_t *c, u32 n) {
+    qsort(c, n, sizeof(cancel_t), cancel_cmp);
+    u32 j = 0;
+    for (u32 i = 0; i < n; i++) {
+        if (j && c[j-1].src == c[i].src) continue;
+        c[j++] = c[i];
+    }
+    return j;
+}
+
+// Is ep one of the events that the (sorted) cancel entries cover?
+bool cancel_find(cancel_t *c, u32 n, event_t *ep) {
+    u32 lo = 0, hi = n;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (c[mid].src < ep->src) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && c[lo].src == ep->src && ep->seq >= c[lo].seq;
+}
+
+// queue_cancel() callback: free the queued events being annihilated
+bool tw_doomed(part_t *p, u32 e) {
+    if (!cancel_find(p->cancel, p->ncancel, event_get(p, e))) return false;
+    event_free(p, e);
+    return true;
+}
+
+// Tell the partitions that np may have sent messages to that the ones
+// it posted from its (restored) sequence number on are void.
+void tw_send_anti(part_t *p, node_t *np) {
+    peer_t buf[NIMPLICIT];
+    u32 npeer;
+    peer_t const *peer = node_peers(np, buf, &npeer);
+    for (u32 j = 0; j < npeer; j++) {
+        peer_t const *pp = &peer[j];
+        part_t *q = node[pp->ni].part;
+        if (q == p) continue;
+        outbox_t *ob = &p->outbox[q->pi];
+        if (ob->nmsg && ob->msg[ob->nmsg-1].anti &&
+                ob->msg[ob->nmsg-1].src == np->id) {
+            continue;
+        }
+        outbox_add(ob, (msg_t) { 0, np->id, np->seq, 0, true, 0 });
+    }
+}
+
+void tw_gather(part_t *p) {
+    for (u32 i = 0; i < npart; i++) {
+        outbox_t *ob = &part[i].outbox[p->pi];
+        if (p->ninbox + ob->nmsg > p->inbox_nalloc) {
+            p->inbox_nalloc = (p->ninbox + ob->nmsg) * 2;
+            p->inbox = realloc(p->inbox, p->inbox_nalloc*sizeof(msg_t));
+            if (!p->inbox) fail("out of memory!");
+        }
+        memcpy(&p->inbox[p->ninbox], ob->msg, ob->nmsg*sizeof(msg_t));
+        p->ninbox += ob->nmsg;
+        ob->nmsg = 0;
+    }
+}
+
+void tw_apply(part_t *p) {
+    p->ncancel = 0;
+    for (u32 i = 0; i < p->ninbox; i++) {
+        if (p->inbox[i].anti) {
+            tw_cancel_add(p, p->inbox[i].src, p->inbox[i].seq);
+        }
+    }
+    u32 const nanti = p->ncancel = cancel_sort(p->cancel, p->ncancel);
+
+    // Roll back to the earliest dispatched event that an anti-message
+    // annihilates, or the earliest straggler, whichever is first.
+    event_t k;
+    bool roll = false;
+    for (u32 i = 0; i < p->nlog && nanti; i++) {
+        if (cancel_find(p->cancel, nanti, &p->log[i].ev)) {
+            k = p->log[i].ev;
+            roll = true;
+            break;
+        }
+    }
+    for (u32 i = 0; i < p->ninbox; i++) {
+        msg_t *m = &p->inbox[i];
+        if (m->anti) continue;
+        event_t me = { .time = m->time, .src = m->src, .seq = m->seq };
+        if (p->nlog && event_before(&me, &p->log[p->nlog-1].ev) &&
+                (!roll || event_before(&me, &k))) {
+            k = me;
+            roll = true;
+        }
+    }
+    if (roll) tw_rollback(p, &k);
+
+    // The events that our rolled back nodes posted are void.
+    for (u32 i = nanti; i < p->ncancel; i++) {
+        node_t *np = &node[node_index[p->cancel[i].src]];
+        p->cancel[i].seq = np->seq;
+        np->rolled = false;
+        tw_send_anti(p, np);
+    }
+    for (u32 i = 0; i < p->ninbox; i++) {
+        msg_t *m = &p->inbox[i];
+        if (m->anti) continue;
+        u32 e = event_alloc(p);
+        event_t *ep = event_get(p, e);
+        ep->time = m->time;
+        ep->src = m->src;
+        ep->seq = m->seq;
+        ep->ni = m->ni;
+        ep->mining = false;
+        ep->block = block_ref(m->blockid);
+        ep->kind = EV_RELAY;
+        queue_add(p, e);
+    }
+    p->ninbox = 0;
+
+    // Annihilate.
+    if (!p->ncancel) return;
+    p->ncancel = cancel_sort(p->cancel, p->ncancel);
+    queue_cancel(p, tw_doomed);
+    p->ncancel = 0;
+}
+
+// Forget how to undo the events before the GVT; they're final.
+void tw_fossil(part_t *p, simtime_t gvt) {
+    u32 n = 0;
+    while (n < p->nlog && p->log[n].ev.time < gvt) n++;
+    if (!n) return;
+    for (u32 i = 0; i < n; i++) {
+        twlog_t *lg = &p->log[i];
+        if (lg->ev.kind == EV_FANOUT && lg->finished) {
+            event_free(p, lg->fanout);
+        }
+    }
+    p->commit_time = p->log[n-1].ev.time;
+    p->nlog -= n;
+    memmove(p->log, &p->log[n], p->nlog*sizeof(twlog_t));
+}
+
+u64 total_undone(void) {
+    u64 n = 0;
+    for (u32 i = 0; i < npart; i++) n += part[i].nundone;
+    return n;
+}
+
+bool outbox_pending(void) {
+    for (u32 i = 0; i < npart; i++) {
+        for (u32 j = 0; j < npart; j++) {
+            if (part[i].outbox[j].nmsg) return true;
+        }
+    }
+    return false;
+}
+
+void sim_optimistic(void) {
+    for (u32 i = 0; i < npart; i++) part[i].keep_fanouts = true;
+    part_threads_start();
+    while (true) {
+        while (outbox_pending()) {
+            part_command(CMD_GATHER);
+            part_command(CMD_APPLY);
+        }
+        part_t *gp = earliest_part(false);
+        simtime_t gvt = gp ?
+            event_get(gp, queue_first(gp))->time : TIME_NEVER;
+        for (u32 i = 0; i < npart; i++) tw_fossil(&part[i], gvt);
+        if (gvt >= endtime) break;
+        if (total_events() - total_undone() >= maxevent) {
+            // back out everything that isn't final
+            event_t k = *event_get(gp, queue_first(gp));
+            for (u32 i = 0; i < npart; i++) tw_rollback(&part[i], &k);
+            break;
+        }
+        if (gvt >= clean_time) {
+            clean_maybe();
+            clean_time += CLEAN_INTERVAL;
+            continue;
+        }
+        if (event_mines(event_get(gp, queue_first(gp)))) {
+            // this can't be rolled back, so it's safe to create the block
+            tw_dispatch(gp);
+            continue;
+        }
+        window_end = time_min(time_min(time_add(gvt, optimism), clean_time),
+            time_min(endtime, time_add(mining_next, 1)));
+        part_command(CMD_OPTIMISTIC);
+    }
+    part_threads_stop();
+}
+
+void usage(void) {
+    fail("usage: sim [-s node_shift] [-p partitions] [-w optimism] "
+        "[-r seed] [-n maxevents] [-t endtime] "
+        "[-q heap|dheap|calendar|ladder|radix] [-m node|global] "
+        "[-j jitter] [-l loss] [-a archive] [-o] [-f] "
+        "[-g distance|regular|scalefree|implicit] [-i graph] [-b interval]");
+}
+
+int main(int argc, char **argv) {
+    char const *archive_path = NULL;
+    npart = 1;
+    int c;
+    while ((c = getopt(argc, argv, "s:p:w:r:n:t:b:q:m:j:l:a:ofg:i:")) != -1) {
+        switch (c) {
+        case 's': node_shift = atoi(optarg); break;
+        case 'p': npart = atoi(optarg); break;
+        case 'w': optimism = seconds(atof(optarg)); break;
+        case 'r': seed = atoi(optarg); break;
+        case 'n': maxevent = strtoull(optarg, NULL, 0); break;
+        case 't': endtime = seconds(atof(optarg)); break;
+        case 'b': block_interval = atof(optarg); break;
+        case 'q':
+            queue = NULL;
+            for (u32 i = 0; i < NQUEUE; i++) {
+                if (!strcmp(optarg, queues[i].name)) queue = &queues[i];
+            }
+            if (!queue) usage();
+            break;
+        case 'm':
+            if (!strcmp(optarg, "global")) mining_global = true;
+            else if (strcmp(optarg, "node")) usage();
+            break;
+        case 'j': jitter_mean = atof(optarg); break;
+        case 'l': loss_rate = atof(optarg); break;
+        case 'a': archive_path = optarg; break;
+        case 'o': renumber = true; break;
+        case 'f': relay_fanout = true; break;
+        case 'i': graph_path = optarg; break;
+        case 'g':
+            if (!strcmp(optarg, "regular")) topology = TOPO_REGULAR;
+            else if (!strcmp(optarg, "scalefree")) topology = TOPO_SCALEFREE;
+            else if (!strcmp(optarg, "implicit")) topology = TOPO_IMPLICIT;
+            else if (strcmp(optarg, "distance")) usage();
+            break;
+        default: usage();
+        }
     }
+    if (node_shift < 1 || node_shift > MAX_NODE_SHIFT || npart < 1) usage();
+    if (jitter_mean < 0 || loss_rate < 0 || loss_rate >= 1) usage();
+    if (!(block_interval > 0)) usage();
+    // (implicit peers are computed from the node index)
+    if (topology == TOPO_IMPLICIT && (renumber || graph_path)) usage();
+    latency_model = jitter_mean > 0 || loss_rate > 0;
+    rand_init();
+    latency_init();
+    region_init();
     block_init();
-    event_init();
-    heap_init();
     node_init();
+    if (npart > nnode) npart = nnode;
+    topology_init();
+    if (renumber) node_renumber();
+    if (archive_path) archive_open(archive_path);
+    part = calloc(npart, sizeof(part_t));
+    for (u32 i = 0; i < npart; i++) {
+        part_t *p = &part[i];
+        p->pi = i;
+        p->pt = protothread_create();
+        p->outbox = calloc(npart, sizeof(outbox_t));
+        event_init(p);
+        p->queue = queue;
+        queue->init(p);
+    }
 
-    protothread_t pt = protothread_create();
     for (u32 ni = 0; ni < nnode; ni++) {
         node_t *np = &node[ni];
-        np->qhead = QHEAD_EMPTY;
+        np->inbox = NOBLOCK;
+        np->inbox_mined = NOBLOCK;
+        np->mining_event = QEND;
+        np->arrival_event = QEND;
+        np->arrived = NOBLOCK;
         np->ni = ni;
-        if (ni == 0 || !randrange(3000)) {
+        // contiguous ranges, most peers are close by
+        np->part = &part[(u64)ni * npart / nnode];
+        if (np->part->node_end == 0) np->part->node_first = ni;
+        np->part->node_end = ni + 1;
+        np->rng = rand_stream(RNG_MINING, np->id);
+        u64 r = rand_stream(RNG_MINER, np->id);
+        if (np->id == 0 || !randrange(&r, 3000)) {
             // let's make this node a miner (must have at least one)
             np->hashrate = 1.0; // should be variable
             miner[nminer++] = ni;
+            totalhash += np->hashrate;
         }
-        pt_create(pt, &np->pt_thread, node_thr, np);
+        pt_create(np->part->pt, &np->pt_thread, node_thr, np);
     }
     miner = realloc(miner, nminer * sizeof(u32));
-    for (u32 i = 0; i < 80*1000*1000; i++) {
-        while (protothread_run(pt));
-        if (!nheap) break;
-        if (nblock > 1000) clean_blocks();
-        u32 e = heap_pop();
-        event_t *ep = &event[e];
-        current_time = ep->time;
-        ep->notify(pt, e); // should make a thread runnable
+    if (renumber) qsort(miner, nminer, sizeof(u32), miner_cmp);
+    getblock(baseblockid)->ntip = nminer;
+    // (the nodes start mining)
+    for (u32 i = 0; i < npart; i++) {
+        while (protothread_run(part[i].pt));
     }
+    if (mining_global) {
+        mining_rng = rand_stream(RNG_MINING, nnode);
+        alias_init();
+        mining_post(0);
+    }
+
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+    if (npart == 1) sim_serial();
+    else if (optimism > 0) sim_optimistic();
+    else sim_parallel();
+    gettimeofday(&stop, NULL);
     clean_blocks();
+    archive_close();
+
+    simtime_t current_time = 0;
+    u32 maxreorg = 0;
+    u64 height = 0;
+    for (u32 i = 0; i < npart; i++) {
+        if (current_time < part[i].current_time) {
+            current_time = part[i].current_time;
+        }
+    }
+    for (u32 ni = 0; ni < nnode; ni++) {
+        if (maxreorg < node[ni].maxreorg) maxreorg = node[ni].maxreorg;
+    }
+    for (u32 i = 0; i < nminer; i++) {
+        if (height < node[miner[i]].tipheight) {
+            height = node[miner[i]].tipheight;
+        }
+    }
+    // (no-op arrivals from other partitions can move the last event time)
+    if (endtime < TIME_NEVER) current_time = endtime;
+    printf("time %.3f height %llu maxreorg %u\n",
+        time_sec(current_time), height, maxreorg);
+    for (u32 i = 0; i < nminer; i++) {
+        node_t *np = &node[miner[i]];
+        printf("miner %u mined %llu credit %llu\n",
+            np->id, np->mined, np->credit);
+    }
+    double elapsed = (stop.tv_sec - start.tv_sec) +
+        (stop.tv_usec - start.tv_usec) / 1e6;
+    u64 nevent = total_events() - total_undone();
+    fprintf(stderr, "%s %s: %llu events in %.2f sec (%.0f events/sec)\n",
+        npart == 1 ? "serial" : optimism > 0 ? "optimistic" : "conservative",
+        queue->name, nevent, elapsed, nevent / elapsed);
+    if (npart > 1 && optimism == 0) {
+        fprintf(stderr, "lookahead %.3f sec, %llu windows\n",
+            time_sec(lookahead), nwindow);
+    }
+    if (optimism > 0) {
+        u64 nrollback = 0;
+        for (u32 i = 0; i < npart; i++) nrollback += part[i].nrollback;
+        fprintf(stderr, "%llu rollbacks undid %llu events\n",
+            nrollback, total_undone());
+    }
+    {
+        u64 nremoved = 0;
+        relay_stats_t rs = { 0, 0, 0, 0 };
+        for (u32 i = 0; i < npart; i++) {
+            nremoved += part[i].nremoved;
+            rs.sent += part[i].relay.sent;
+            rs.coalesced += part[i].relay.coalesced;
+            rs.ignored += part[i].relay.ignored;
+            rs.lost += part[i].relay.lost;
+        }
+        fprintf(stderr, "saved %llu superseded mining events; relays: "
+            "%llu sent, %llu coalesced, %llu ignored on arrival, "
+            "%llu lost\n",
+            nremoved, rs.sent, rs.coalesced, rs.ignored, rs.lost);
+    }
     if(0) for (u32 ni = 0; ni < nnode; ni++) {
         printf("%d: ", ni);
-        for (u32 j = 0; j < NPEER; j++) {
-            if (node[ni].peer[j].delay == 0) continue;
-            printf("[%d %f], ", node[ni].peer[j].ni, node[ni].peer[j].delay);
+        for (u32 j = 0; j < node[ni].npeer; j++) {
+            printf("[%d %f], ", node[ni].peer[j].ni,
+                time_sec(link_delay(&node[ni], node[ni].peer[j].ni, 0)));
         }
         printf("\n");
     }
@@ -0,0 +1,92 @@
+// Read a block archive written by sim -a (see archive.h): print how many
+// blocks were final, orphaned or pending, and each miner's share, or
+// with -v, every block.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+void fail(char *message) {
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+void usage(void) {
+    fail("usage: simdump [-v] archive");
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "v")) != -1) {
+        switch (c) {
+        case 'v': verbose = true; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1) usage();
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) fail("can't open archive");
+    struct stat st;
+    if (fstat(fd, &st)) fail("can't stat archive");
+    if ((u64)st.st_size < sizeof(archive_header_t)) fail("not an archive");
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) fail("can't map archive");
+    archive_header_t const *h = map;
+    if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) ||
+            h->version != ARCHIVE_VERSION ||
+            h->record_size != sizeof(archive_record_t)) {
+        fail("not an archive (or another version)");
+    }
+    archive_record_t const *r = (void const *)(h + 1);
+    u64 const nrecord = (st.st_size - sizeof(*h)) / sizeof(*r);
+
+    // by status, and by miner and status
+    u64 count[3] = { 0, 0, 0 };
+    u64 (*mined)[3] = calloc(h->nnode, sizeof(*mined));
+    if (!mined) fail("out of memory!");
+    u64 height = 0;
+    for (u64 i = 0; i < nrecord; i++) {
+        if (r[i].status > ARC_ORPHAN || r[i].miner >= h->nnode) {
+            fail("corrupt archive");
+        }
+        if (verbose) {
+            static char const *status[] = { "pending", "final", "orphan" };
+            printf("%llu parent %llu height %llu miner %u %s\n",
+                (u64)r[i].id, (u64)r[i].parent, (u64)r[i].height,
+                r[i].miner, status[r[i].status]);
+        }
+        // (the first block wasn't mined)
+        if (r[i].height == 0) continue;
+        count[r[i].status]++;
+        mined[r[i].miner][r[i].status]++;
+        if (r[i].status == ARC_FINAL && height < r[i].height) {
+            height = r[i].height;
+        }
+    }
+    printf("seed %u nodes %u blocks %llu final %llu orphaned %llu "
+        "pending %llu height %llu\n", h->seed, h->nnode,
+        count[ARC_FINAL] + count[ARC_ORPHAN] + count[ARC_PENDING],
+        count[ARC_FINAL], count[ARC_ORPHAN], count[ARC_PENDING], height);
+    for (u32 mi = 0; mi < h->nnode; mi++) {
+        u64 const *m = mined[mi];
+        u64 const n = m[ARC_FINAL] + m[ARC_ORPHAN] + m[ARC_PENDING];
+        if (n == 0) continue;
+        printf("miner %u mined %llu final %llu orphaned %llu (%.2f%%)\n",
+            mi, n, m[ARC_FINAL], m[ARC_ORPHAN],
+            100.0 * m[ARC_ORPHAN] / (m[ARC_FINAL] + m[ARC_ORPHAN] ?
+                m[ARC_FINAL] + m[ARC_ORPHAN] : 1));
+    }
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Convert an edge list to a graph file for sim -i (see graph.h). Each
+// line of the edge list is two node numbers (from 0); blank lines and
+// lines starting with # are skipped, and so are links from a node to
+// itself and links given more than once. With -r, a file of "node
+// region" lines, some nodes' regions are given; the rest are in equal
+// ranges of node number, as sim makes them.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "graph.h"
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+// (as sim allows: its random streams are keyed by node index in 25 bits)
+#define MAXNODE (1 << 24)
+
+void fail(char *message) {
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+void usage(void) {
+    fail("usage: simgraph [-r regions] edges graph");
+}
+
+// Read a line's two numbers, false if there are none (a blank line or
+// a comment).
+bool read_pair(FILE *f, u64 *a, u64 *b) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *s = line + strspn(line, " \t");
+        if (*s == '#' || *s == '\n' || *s == '\r' || *s == '\0') continue;
+        if (sscanf(s, "%llu %llu", a, b) != 2) fail("bad line");
+        return true;
+    }
+    return false;
+}
+
+int u32_cmp(void const *a, void const *b) {
+    u32 const x = *(u32 const *)a, y = *(u32 const *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    char const *region_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "r:")) != -1) {
+        switch (c) {
+        case 'r': region_path = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 2) usage();
+
+    // the links, as pairs of node numbers
+    FILE *f = fopen(argv[optind], "r");
+    if (!f) fail("can't open edge list");
+    u32 *edge = NULL;
+    u64 nedge = 0, edge_nalloc = 0;
+    u32 nnode = 0;
+    u64 a, b;
+    while (read_pair(f, &a, &b)) {
+        if (a >= MAXNODE || b >= MAXNODE) fail("node number too large");
+        if (a == b) continue;
+        if (nedge == edge_nalloc) {
+            edge_nalloc = edge_nalloc ? edge_nalloc * 2 : 1 << 16;
+            edge = realloc(edge, edge_nalloc * 2 * sizeof(u32));
+            if (!edge) fail("out of memory!");
+        }
+        edge[2*nedge] = a;
+        edge[2*nedge+1] = b;
+        nedge++;
+        if (nnode <= a) nnode = a + 1;
+        if (nnode <= b) nnode = b + 1;
+    }
+    fclose(f);
+    if (nnode == 0) fail("no links");
+
+    // Lay out the peer lists (both ends of each link), then sort each
+    // and squeeze out the repeats.
+    u64 *offset = calloc(nnode + 1, sizeof(u64));
+    u64 *next = malloc(nnode * sizeof(u64));
+    u32 *peer = malloc(nedge * 2 * sizeof(u32));
+    u8 *region = malloc(nnode);
+    if (!offset || !next || !peer || !region) fail("out of memory!");
+    for (u64 i = 0; i < nedge; i++) {
+        offset[edge[2*i] + 1]++;
+        offset[edge[2*i+1] + 1]++;
+    }
+    for (u32 ni = 0; ni < nnode; ni++) {
+        offset[ni+1] += offset[ni];
+        next[ni] = offset[ni];
+    }
+    for (u64 i = 0; i < nedge; i++) {
+        peer[next[edge[2*i]]++] = edge[2*i+1];
+        peer[next[edge[2*i+1]]++] = edge[2*i];
+    }
+    free(edge);
+    free(next);
+    u64 npeer = 0;
+    for (u32 ni = 0; ni < nnode; ni++) {
+        u64 const start = offset[ni], end = offset[ni+1];
+        qsort(&peer[start], end - start, sizeof(u32), u32_cmp);
+        offset[ni] = npeer;
+        for (u64 j = start; j < end; j++) {
+            if (j == start || peer[j] != peer[j-1]) peer[npeer++] = peer[j];
+        }
+    }
+    offset[nnode] = npeer;
+
+    for (u32 ni = 0; ni < nnode; ni++) {
+        region[ni] = (u64)ni * GRAPH_NREGION / nnode;
+    }
+    if (region_path) {
+        f = fopen(region_path, "r");
+        if (!f) fail("can't open regions");
+        while (read_pair(f, &a, &b)) {
+            if (a >= nnode || b >= GRAPH_NREGION) fail("bad region");
+            region[a] = b;
+        }
+        fclose(f);
+    }
+
+    graph_header_t h = { GRAPH_MAGIC, GRAPH_VERSION, nnode, npeer };
+    f = fopen(argv[optind+1], "wb");
+    if (!f) fail("can't create graph");
+    if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(offset, sizeof(u64), nnode + 1, f) != nnode + 1 ||
+            fwrite(peer, sizeof(u32), npeer, f) != npeer ||
+            fwrite(region, 1, nnode, f) != nnode ||
+            fclose(f)) {
+        fail("can't write graph");
+    }
+    printf("nodes %u links %llu\n", nnode, npeer / 2);
+    return 0;
+}